@@ -1,22 +1,41 @@
 #include "include/filesystem.h"
+#include "include/trace.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "esp_system.h"
 #include <inttypes.h>
 #include "esp_partition.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include <inttypes.h>
+#include "freertos/semphr.h"
+#include "esp_rom_crc.h"
 
 #define STORAGE_NAMESPACE "storage"
 #define SECTOR_SIZE 4096
 #define NUM_SECTORS 32
-#define HEADER_SIZE 12
+#define META_SECTORS 4
+#define NUM_BLOCKS (NUM_SECTORS - META_SECTORS)
+#define HEADER_SIZE 16
+#define BLOCK_END -1
+#define BLOCK_FREE -2
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CRC_CHUNK_SIZE 256
+#define SCRUB_INTERVAL_MS 100
+#define SCRUB_IDLE_MS 500
 
-// Magic (4 bytes) + Timestamp (4 bytes) + num_files (4 bytes)
+// Partition layout: sectors [0, META_SECTORS) hold rotating snapshots of the
+// file table, the rest are FS_BLOCK_SIZE data blocks.
+// Snapshot: magic (4 bytes) + generation (4 bytes) + num_files (4 bytes) +
+// CRC32 of the rest (4 bytes), then File[num_files], the block chain table
+// and the per-block CRC32 table.
+_Static_assert(FS_BLOCK_SIZE == SECTOR_SIZE, "data blocks must be whole flash sectors");
+_Static_assert(HEADER_SIZE + sizeof(File) * MAX_FILES + (sizeof(int16_t) + sizeof(uint32_t)) * NUM_BLOCKS <= SECTOR_SIZE,
+               "metadata snapshot must fit in one sector");
 
 
 static const char *TAG = "filesystem";
@@ -24,15 +43,64 @@ static const esp_partition_t* storage_partition;
 
 static File files[MAX_FILES];
 static uint32_t num_files = 0;
-static int current_dir = 0;
-static char current_path[MAX_PATH_LENGTH] = "/";
+// The shell's working directory. Other tasks, such as background jobs, can
+// select their own with fs_use_cwd() so that their cd and relative paths
+// stay out of the shell's way.
+static fs_cwd_t shell_cwd = {0, "/"};
+static __thread fs_cwd_t* task_cwd;
+
+static fs_cwd_t* cwd(void) {
+    return task_cwd ? task_cwd : &shell_cwd;
+}
 static uint32_t current_sector = 0;
-static const uint8_t HEADER_MAGIC[4] = {'F', 'S', 'Y', 'S'};
+static uint32_t generation = 0;
+static const uint8_t HEADER_MAGIC[4] = {'F', 'S', 'Y', '3'};
+
+// Next block in each file's chain, BLOCK_END, or BLOCK_FREE. Blocks released
+// since the last snapshot are marked pending: the snapshot on flash still
+// references them, so they must not be reused until the next one is written.
+static int16_t block_next[NUM_BLOCKS];
+static bool block_pending[NUM_BLOCKS];
+static uint32_t next_alloc = 0;
+
+// CRC32 of the used bytes of each block, checked on every read and by the
+// scrubber. data_epoch changes whenever any block's contents change, which
+// lets the scrubber verify a block without holding the lock.
+static uint32_t block_crc[NUM_BLOCKS];
+static bool block_bad[NUM_BLOCKS];
+static uint32_t data_epoch = 0;
+
+// Location of the most recent snapshot, for the scrubber.
+static uint32_t snapshot_sector = 0;
+static uint32_t snapshot_size = 0;
+static uint32_t snapshot_crc = 0;
+
+static SemaphoreHandle_t fs_mutex;
+static volatile TickType_t last_io_tick = 0;
+static fs_scrub_stats_t scrub_stats;
+
+static esp_err_t write_to_flash_locked(void);
+
+static void fs_lock(void) {
+    xSemaphoreTakeRecursive(fs_mutex, portMAX_DELAY);
+    last_io_tick = xTaskGetTickCount();
+}
+
+static void fs_unlock(void) {
+    xSemaphoreGiveRecursive(fs_mutex);
+}
 
 
 esp_err_t fs_init(void) {
     ESP_LOGI(TAG, "Initializing filesystem...");
 
+    if (fs_mutex == NULL) {
+        fs_mutex = xSemaphoreCreateRecursiveMutex();
+        if (fs_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
     esp_err_t err = fs_init_storage();
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to initialize storage: %s", esp_err_to_name(err));
@@ -57,39 +125,507 @@ esp_err_t fs_init(void) {
 }
 
 void fs_dump_state(void) {
+    fs_lock();
     ESP_LOGI(TAG, "Current filesystem state:");
     ESP_LOGI(TAG, "Number of files: %" PRIu32, num_files);
     for (int i = 0; i < num_files; i++) {
         ESP_LOGI(TAG, "File %d: %s, is_dir: %d, parent_dir: %d, size: %" PRIu32,
             i, files[i].name, files[i].is_dir, files[i].parent_dir, files[i].size);
     }
+    fs_unlock();
+}
+
+// Name index: the used slots of a file table (root excluded) sorted by name,
+// ties broken by slot. Resolving a path component, or finding every entry
+// whose name starts with a prefix, is a binary search plus a walk over the
+// matches instead of a scan of the whole table. It is kept in step with the
+// table on create and delete and rebuilt whenever a table is loaded.
+typedef struct {
+    const File* table;
+    uint16_t* order;
+    uint32_t count;
+} name_index_t;
+
+static uint16_t name_order[MAX_FILES];
+static name_index_t name_index = { files, name_order, 0 };
+
+static int compare_index_key(const File* table, uint16_t slot, const char* name, uint32_t key_slot) {
+    int cmp = strcmp(table[slot].name, name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (slot > key_slot) - (slot < key_slot);
+}
+
+// Returns the first position whose entry sorts at or after (name, slot).
+static uint32_t index_lower_bound(const name_index_t* index, const char* name, uint32_t slot) {
+    uint32_t low = 0;
+    uint32_t high = index->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (compare_index_key(index->table, index->order[mid], name, slot) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void index_insert(name_index_t* index, uint16_t slot) {
+    uint32_t pos = index_lower_bound(index, index->table[slot].name, slot);
+    memmove(&index->order[pos + 1], &index->order[pos], (index->count - pos) * sizeof(uint16_t));
+    index->order[pos] = slot;
+    index->count++;
+}
+
+static void index_remove(name_index_t* index, uint16_t slot) {
+    uint32_t pos = index_lower_bound(index, index->table[slot].name, slot);
+    if (pos < index->count && index->order[pos] == slot) {
+        memmove(&index->order[pos], &index->order[pos + 1], (index->count - pos - 1) * sizeof(uint16_t));
+        index->count--;
+    }
+}
+
+// qsort() has no context argument; index_build() runs under the lock.
+static const File* sort_table;
+
+static int compare_index_slots(const void* a, const void* b) {
+    uint16_t slot_b = *(const uint16_t*)b;
+    return compare_index_key(sort_table, *(const uint16_t*)a, sort_table[slot_b].name, slot_b);
+}
+
+static void index_build(name_index_t* index, uint32_t num_entries) {
+    index->count = 0;
+    for (uint32_t i = 1; i < num_entries; i++) {
+        if (index->table[i].name[0] != '\0') {
+            index->order[index->count++] = i;
+        }
+    }
+    sort_table = index->table;
+    qsort(index->order, index->count, sizeof(uint16_t), compare_index_slots);
+}
+
+// Returns the slot of the entry called `name` in directory `parent`, or -1.
+static int index_find_child(const name_index_t* index, int parent, const char* name) {
+    for (uint32_t pos = index_lower_bound(index, name, 0); pos < index->count; pos++) {
+        const File* entry = &index->table[index->order[pos]];
+        if (strcmp(entry->name, name) != 0) {
+            break;
+        }
+        if (entry->parent_dir == parent) {
+            return index->order[pos];
+        }
+    }
+    return -1;
 }
 
 static int find_file(const char* path) {
+    TRACE_BEGIN(TRACE_EV_FIND_FILE, 0);
     char temp_path[MAX_PATH_LENGTH];
     strcpy(temp_path, path);
     char* token = strtok(temp_path, "/");
 
     // Start from root if path is absolute
-    int current = (path[0] == '/') ? 0 : current_dir;
+    int current = (path[0] == '/') ? 0 : cwd()->dir;
 
-    while (token != NULL) {
-        bool found = false;
-        for (int i = 0; i < num_files; i++) {
-            if (files[i].parent_dir == current && strcmp(files[i].name, token) == 0) {
-                current = i;
-                found = true;
-                break;
-            }
-        }
-        if (!found) return -1;
+    while (token != NULL && current != -1) {
+        current = index_find_child(&name_index, current, token);
         token = strtok(NULL, "/");
     }
+    TRACE_END(TRACE_EV_FIND_FILE, (uint32_t)current);
     return current;
 }
 
+// Returns a free slot in the file table. Deleted entries are cleared in place
+// rather than compacted, so a file's index (its inode) never changes while it
+// exists and parent_dir links stay valid.
+static int alloc_slot(void) {
+    for (int i = 1; i < num_files; i++) {
+        if (files[i].name[0] == '\0') {
+            return i;
+        }
+    }
+    if (num_files >= MAX_FILES) {
+        return -1;
+    }
+    return num_files++;
+}
 
-bool fs_create_file(const char* path, const char* content) {
+static void free_slot(int index) {
+    index_remove(&name_index, index);
+    memset(&files[index], 0, sizeof(File));
+    files[index].parent_dir = -1;
+    while (num_files > 1 && files[num_files - 1].name[0] == '\0') {
+        num_files--;
+    }
+}
+
+
+static void reset_tables(void) {
+    num_files = 1;
+    memset(files, 0, sizeof(files));
+    strcpy(files[0].name, "/");
+    files[0].is_dir = true;
+    files[0].parent_dir = -1;
+    files[0].first_block = BLOCK_END;
+    name_index.count = 0;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        block_next[i] = BLOCK_FREE;
+        block_pending[i] = false;
+        block_crc[i] = 0;
+        block_bad[i] = false;
+    }
+    next_alloc = 0;
+    data_epoch++;
+    current_sector = 0;
+}
+
+static size_t block_offset(int block) {
+    return (size_t)(META_SECTORS + block) * SECTOR_SIZE;
+}
+
+static uint32_t blocks_for_size(uint32_t size) {
+    return (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+static uint32_t count_free_blocks(void) {
+    uint32_t count = 0;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (block_next[i] == BLOCK_FREE && !block_pending[i]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static uint32_t count_pending_blocks(void) {
+    uint32_t count = 0;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (block_pending[i]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Links `count` free blocks into a new chain. Allocation continues from where
+// the previous one stopped, which spreads erases across the partition and
+// keeps consecutive allocations physically contiguous.
+static bool alloc_chain(uint32_t count, int* first) {
+    if (count_free_blocks() < count && count_pending_blocks() > 0) {
+        // Writing a snapshot releases the pending blocks.
+        write_to_flash_locked();
+    }
+    if (count_free_blocks() < count) {
+        return false;
+    }
+
+    int prev = BLOCK_END;
+    *first = BLOCK_END;
+    for (uint32_t allocated = 0; allocated < count; next_alloc = (next_alloc + 1) % NUM_BLOCKS) {
+        if (block_next[next_alloc] != BLOCK_FREE || block_pending[next_alloc]) {
+            continue;
+        }
+        block_next[next_alloc] = BLOCK_END;
+        if (prev == BLOCK_END) {
+            *first = next_alloc;
+        } else {
+            block_next[prev] = next_alloc;
+        }
+        prev = next_alloc;
+        allocated++;
+    }
+    return true;
+}
+
+// Returns a chain that the last snapshot may reference to the allocator.
+static void release_chain(int first) {
+    while (first >= 0) {
+        int next = block_next[first];
+        block_next[first] = BLOCK_FREE;
+        block_pending[first] = true;
+        block_bad[first] = false;
+        first = next;
+    }
+}
+
+// Returns a chain that no snapshot has seen yet; it is reusable immediately.
+static void discard_chain(int first) {
+    while (first >= 0) {
+        int next = block_next[first];
+        block_next[first] = BLOCK_FREE;
+        block_bad[first] = false;
+        first = next;
+    }
+}
+
+// Number of physically consecutive blocks starting at `block`, up to `max`.
+static uint32_t run_length(int block, uint32_t max) {
+    uint32_t run = 1;
+    while (run < max && block_next[block] == block + 1) {
+        block++;
+        run++;
+    }
+    return run;
+}
+
+// Erases and fills a freshly allocated chain. Physically contiguous blocks are
+// handled with one erase and one write, so large files go to flash at close to
+// raw partition speed.
+static esp_err_t write_blocks(int block, const uint8_t* data, uint32_t size) {
+    while (size > 0 && block >= 0) {
+        uint32_t run = run_length(block, blocks_for_size(size));
+        uint32_t len = MIN(size, run * FS_BLOCK_SIZE);
+
+        esp_err_t err = esp_partition_erase_range(storage_partition, block_offset(block), run * SECTOR_SIZE);
+        if (err == ESP_OK) {
+            err = esp_partition_write(storage_partition, block_offset(block), data, len);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write data block %d: %s", block, esp_err_to_name(err));
+            return err;
+        }
+
+        for (uint32_t i = 0; i < run; i++) {
+            uint32_t block_len = MIN(len - i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+            block_crc[block + i] = esp_rom_crc32_le(0, data + i * FS_BLOCK_SIZE, block_len);
+            block_bad[block + i] = false;
+        }
+        data_epoch++;
+
+        data += len;
+        size -= len;
+        block += run - 1;
+        block = block_next[block];
+    }
+    return ESP_OK;
+}
+
+// Folds bytes [from, to) of the region at partition offset `base` into `crc`,
+// reading in small chunks.
+static esp_err_t crc_flash_range(size_t base, uint32_t from, uint32_t to, uint32_t* crc) {
+    uint8_t buffer[CRC_CHUNK_SIZE];
+    while (from < to) {
+        uint32_t chunk = MIN(to - from, sizeof(buffer));
+        esp_err_t err = esp_partition_read(storage_partition, base + from, buffer, chunk);
+        if (err != ESP_OK) {
+            return err;
+        }
+        *crc = esp_rom_crc32_le(*crc, buffer, chunk);
+        from += chunk;
+    }
+    return ESP_OK;
+}
+
+// Checks a block whose bytes [from, to) have already been read into `data`.
+// The rest of its used bytes are read back so the stored CRC can be compared.
+static esp_err_t verify_block(int block, uint32_t used, const uint8_t* data, uint32_t from, uint32_t to) {
+    uint32_t crc = 0;
+    esp_err_t err = crc_flash_range(block_offset(block), 0, from, &crc);
+    if (err == ESP_OK) {
+        crc = esp_rom_crc32_le(crc, data, to - from);
+        err = crc_flash_range(block_offset(block), to, used, &crc);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (crc != block_crc[block]) {
+        ESP_LOGE(TAG, "CRC mismatch in data block %d: 0x%08" PRIx32 " != 0x%08" PRIx32, block, crc, block_crc[block]);
+        block_bad[block] = true;
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+// Reads `len` bytes at `offset` of the file whose chain starts at `block` and
+// verifies the CRC of every block the read touches.
+static esp_err_t read_blocks(int block, uint32_t file_size, uint32_t offset, uint8_t* data, uint32_t len) {
+    uint32_t base = 0;
+    while (block >= 0 && offset >= base + FS_BLOCK_SIZE) {
+        block = block_next[block];
+        base += FS_BLOCK_SIZE;
+    }
+
+    while (len > 0 && block >= 0) {
+        uint32_t start = offset - base;
+        uint32_t run = run_length(block, blocks_for_size(start + len));
+        uint32_t chunk = MIN(len, run * FS_BLOCK_SIZE - start);
+
+        esp_err_t err = esp_partition_read(storage_partition, block_offset(block) + start, data, chunk);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read data block %d: %s", block, esp_err_to_name(err));
+            return err;
+        }
+
+        for (uint32_t i = 0; i < run; i++) {
+            uint32_t block_base = base + i * FS_BLOCK_SIZE;
+            uint32_t used = MIN(FS_BLOCK_SIZE, file_size - block_base);
+            uint32_t from = MAX(offset, block_base) - block_base;
+            uint32_t to = MIN(offset + chunk, block_base + FS_BLOCK_SIZE) - block_base;
+            err = verify_block(block + i, used, data + (block_base + from - offset), from, to);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+
+        data += chunk;
+        offset += chunk;
+        len -= chunk;
+        base += run * FS_BLOCK_SIZE;
+        block += run - 1;
+        block = block_next[block];
+    }
+    return len == 0 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+// Replaces the contents of files[index]. The new data goes to a new chain
+// before the old one is released, so the last snapshot stays intact.
+static bool write_file_data(int index, const uint8_t* data, uint32_t size) {
+    int first = BLOCK_END;
+    if (size > 0) {
+        uint32_t needed = blocks_for_size(size);
+        uint32_t available = count_free_blocks() + count_pending_blocks();
+        if (available < needed) {
+            // Not enough room to keep the old contents until the new ones are
+            // written. Truncate first and let the snapshot free the blocks,
+            // but only if that makes enough room; otherwise fail with the old
+            // contents and the snapshot untouched.
+            uint32_t old_blocks = (files[index].first_block >= 0) ? blocks_for_size(files[index].size) : 0;
+            if (available + old_blocks < needed) {
+                ESP_LOGE(TAG, "Not enough space for %" PRIu32 " bytes", size);
+                return false;
+            }
+            release_chain(files[index].first_block);
+            files[index].first_block = BLOCK_END;
+            files[index].size = 0;
+        }
+        if (!alloc_chain(needed, &first)) {
+            ESP_LOGE(TAG, "Not enough space for %" PRIu32 " bytes", size);
+            return false;
+        }
+        if (write_blocks(first, data, size) != ESP_OK) {
+            discard_chain(first);
+            return false;
+        }
+    }
+
+    release_chain(files[index].first_block);
+    files[index].first_block = first;
+    files[index].size = size;
+    return true;
+}
+
+// Checks that `len` bytes at `offset` in `block` are still erased, so they can
+// be programmed without erasing the sector first.
+static bool block_region_erased(int block, uint32_t offset, uint32_t len) {
+    uint32_t buffer[64];
+    while (len > 0) {
+        uint32_t chunk = MIN(len, sizeof(buffer));
+        if (esp_partition_read(storage_partition, block_offset(block) + offset, buffer, chunk) != ESP_OK) {
+            return false;
+        }
+        const uint8_t* bytes = (const uint8_t*)buffer;
+        for (uint32_t i = 0; i < chunk; i++) {
+            if (bytes[i] != 0xFF) {
+                return false;
+            }
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Copies the first `used` bytes of `block` into a newly allocated block.
+static int relocate_block(int block, uint32_t used) {
+    int copy;
+    if (!alloc_chain(1, &copy)) {
+        return BLOCK_END;
+    }
+    uint8_t* buffer = malloc(FS_BLOCK_SIZE);
+    if (!buffer) {
+        discard_chain(copy);
+        return BLOCK_END;
+    }
+    esp_err_t err = esp_partition_read(storage_partition, block_offset(block), buffer, used);
+    if (err == ESP_OK) {
+        err = verify_block(block, used, buffer, 0, used);
+    }
+    if (err == ESP_OK) {
+        err = write_blocks(copy, buffer, used);
+    }
+    free(buffer);
+    if (err != ESP_OK) {
+        discard_chain(copy);
+        return BLOCK_END;
+    }
+    return copy;
+}
+
+static bool append_file_data(int index, const uint8_t* data, uint32_t size) {
+    File* file = &files[index];
+    if (file->first_block < 0) {
+        return write_file_data(index, data, size);
+    }
+
+    int prev = BLOCK_END;
+    int last = file->first_block;
+    while (block_next[last] >= 0) {
+        prev = last;
+        last = block_next[last];
+    }
+    uint32_t used = file->size - (blocks_for_size(file->size) - 1) * FS_BLOCK_SIZE;
+    uint32_t tail = MIN(size, FS_BLOCK_SIZE - used);
+
+    if (tail > 0) {
+        // An append that never made it into a snapshot may have left bytes
+        // past the recorded size; move the block instead of programming
+        // over them.
+        if (!block_region_erased(last, used, tail)) {
+            int copy = relocate_block(last, used);
+            if (copy == BLOCK_END) {
+                ESP_LOGE(TAG, "Failed to relocate data block %d", last);
+                return false;
+            }
+            if (prev == BLOCK_END) {
+                file->first_block = copy;
+            } else {
+                block_next[prev] = copy;
+            }
+            release_chain(last);
+            last = copy;
+        }
+        esp_err_t err = esp_partition_write(storage_partition, block_offset(last) + used, data, tail);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write data block %d: %s", last, esp_err_to_name(err));
+            return false;
+        }
+        block_crc[last] = esp_rom_crc32_le(block_crc[last], data, tail);
+        data_epoch++;
+        file->size += tail;
+        data += tail;
+        size -= tail;
+    }
+
+    if (size > 0) {
+        int first;
+        if (!alloc_chain(blocks_for_size(size), &first)) {
+            ESP_LOGE(TAG, "Not enough space for %" PRIu32 " bytes", size);
+            return false;
+        }
+        if (write_blocks(first, data, size) != ESP_OK) {
+            discard_chain(first);
+            return false;
+        }
+        block_next[last] = first;
+        file->size += size;
+    }
+    return true;
+}
+
+
+static bool create_file_locked(const char* path, const char* content) {
     // Find the parent directory
     char parent_path[MAX_PATH_LENGTH];
     strncpy(parent_path, path, MAX_PATH_LENGTH - 1);
@@ -119,52 +655,55 @@ bool fs_create_file(const char* path, const char* content) {
     }
 
     // Check if file already exists in parent directory
-    for (int i = 0; i < num_files; i++) {
-        if (files[i].parent_dir == parent_dir && strcmp(files[i].name, file_name) == 0) {
-            ESP_LOGE(TAG, "File already exists: %s", path);
-            return false;
-        }
+    if (index_find_child(&name_index, parent_dir, file_name) != -1) {
+        ESP_LOGE(TAG, "File already exists: %s", path);
+        return false;
     }
 
     // Create the new file
-    if (num_files >= MAX_FILES) {
+    int slot = alloc_slot();
+    if (slot == -1) {
         ESP_LOGE(TAG, "Maximum number of files reached");
         return false;
     }
 
-    strncpy(files[num_files].name, file_name, MAX_FILENAME_LENGTH - 1);
-    files[num_files].name[MAX_FILENAME_LENGTH - 1] = '\0';
-    files[num_files].is_dir = false;
-    files[num_files].parent_dir = parent_dir;
-    files[num_files].size = strlen(content);
+    strncpy(files[slot].name, file_name, MAX_FILENAME_LENGTH - 1);
+    files[slot].name[MAX_FILENAME_LENGTH - 1] = '\0';
+    files[slot].is_dir = false;
+    files[slot].parent_dir = parent_dir;
+    files[slot].size = 0;
+    files[slot].first_block = BLOCK_END;
+    index_insert(&name_index, slot);
 
-    // Copy content to data field
-    if (files[num_files].size > MAX_FILE_SIZE) {
-        files[num_files].size = MAX_FILE_SIZE;
-        ESP_LOGW(TAG, "File content truncated to %d bytes", MAX_FILE_SIZE);
+    if (!write_file_data(slot, (const uint8_t*)content, strlen(content))) {
+        free_slot(slot);
+        return false;
     }
-    memcpy(files[num_files].data, content, files[num_files].size);
 
-    num_files++;
     ESP_LOGI(TAG, "File created: %s in directory %s", file_name, parent_path);
     return true;
 }
 
+bool fs_create_file(const char* path, const char* content) {
+    fs_lock();
+    bool ok = create_file_locked(path, content);
+    fs_unlock();
+    return ok;
+}
+
 
-bool fs_write_file(const char* filename, const uint8_t* content, uint32_t size) {
-    char full_path[MAX_PATH_LENGTH];
-    
+static bool build_full_path(const char* filename, char* full_path) {
     if (filename[0] != '/') {
-        size_t current_path_len = strlen(current_path);
+        size_t current_path_len = strlen(cwd()->path);
         size_t filename_len = strlen(filename);
-        size_t separator_len = (current_path[current_path_len - 1] == '/') ? 0 : 1;
+        size_t separator_len = (cwd()->path[current_path_len - 1] == '/') ? 0 : 1;
         
         if (current_path_len + separator_len + filename_len >= MAX_PATH_LENGTH) {
             printf("Path too long\n");
             return false;
         }
         
-        strcpy(full_path, current_path);
+        strcpy(full_path, cwd()->path);
         if (separator_len) {
             strcat(full_path, "/");
         }
@@ -176,103 +715,499 @@ bool fs_write_file(const char* filename, const uint8_t* content, uint32_t size)
         }
         strcpy(full_path, filename);
     }
+    return true;
+}
+
+// Resolves `filename` to a regular file, creating it empty if needed.
+static int open_for_write(const char* filename, char* full_path) {
+    if (!build_full_path(filename, full_path)) {
+        return -1;
+    }
 
     int file_index = find_file(full_path);
     if (file_index == -1) {
         // File doesn't exist, create it
-        if (!fs_create_file(full_path, (const char*)content)) {
+        if (!create_file_locked(full_path, "")) {
             printf("Failed to create file: %s\n", full_path);
-            return false;
+            return -1;
         }
         file_index = find_file(full_path);
     }
 
     if (file_index == -1 || files[file_index].is_dir) {
         printf("Invalid file: %s\n", full_path);
+        return -1;
+    }
+    return file_index;
+}
+
+static bool write_file_locked(const char* filename, const uint8_t* content, uint32_t size) {
+    char full_path[MAX_PATH_LENGTH];
+    int file_index = open_for_write(filename, full_path);
+    if (file_index == -1) {
         return false;
     }
 
-    if (size > MAX_FILE_SIZE) {
+    if (!write_file_data(file_index, content, size)) {
         printf("Content too large for file: %s\n", full_path);
         return false;
     }
+    return true;
+}
+
+bool fs_write_file(const char* filename, const uint8_t* content, uint32_t size) {
+    fs_lock();
+    bool ok = write_file_locked(filename, content, size);
+    fs_unlock();
+    return ok;
+}
+
+static bool append_file_locked(const char* filename, const uint8_t* content, uint32_t size) {
+    char full_path[MAX_PATH_LENGTH];
+    int file_index = open_for_write(filename, full_path);
+    if (file_index == -1) {
+        return false;
+    }
+
+    if (!append_file_data(file_index, content, size)) {
+        printf("Failed to append to file: %s\n", full_path);
+        return false;
+    }
+    return true;
+}
+
+bool fs_append_file(const char* filename, const uint8_t* content, uint32_t size) {
+    fs_lock();
+    bool ok = append_file_locked(filename, content, size);
+    fs_unlock();
+    return ok;
+}
+
+static bool read_file_locked(const char* path, uint8_t* data, uint32_t* size) {
+    int file_index = find_file(path);
+    if (file_index == -1 || files[file_index].is_dir) return false;
 
-    memcpy(files[file_index].data, content, size);
-    files[file_index].size = size;
-    printf("Content written to file: %s (%" PRIu32 " bytes)\n", full_path, size);
+    if (read_blocks(files[file_index].first_block, files[file_index].size, 0, data, files[file_index].size) != ESP_OK) {
+        return false;
+    }
+    *size = files[file_index].size;
     return true;
 }
 
 bool fs_read_file(const char* path, uint8_t* data, uint32_t* size) {
+    fs_lock();
+    bool ok = read_file_locked(path, data, size);
+    fs_unlock();
+    return ok;
+}
+
+static bool read_file_at_locked(const char* path, uint32_t offset, uint8_t* data, uint32_t len, uint32_t* read_len) {
+    int file_index = find_file(path);
+    if (file_index == -1 || files[file_index].is_dir) return false;
+
+    uint32_t size = files[file_index].size;
+    len = (offset >= size) ? 0 : MIN(len, size - offset);
+    if (read_blocks(files[file_index].first_block, size, offset, data, len) != ESP_OK) {
+        return false;
+    }
+    *read_len = len;
+    return true;
+}
+
+bool fs_read_file_at(const char* path, uint32_t offset, uint8_t* data, uint32_t len, uint32_t* read_len) {
+    fs_lock();
+    bool ok = read_file_at_locked(path, offset, data, len, read_len);
+    fs_unlock();
+    return ok;
+}
+
+bool fs_open_reader(const char* path, fs_reader_t* reader) {
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return false;
+    }
+    reader->buffer = malloc(FS_BLOCK_SIZE);
+    if (!reader->buffer) {
+        return false;
+    }
+    strcpy(reader->path, path);
+    reader->offset = 0;
+    reader->block = BLOCK_END;
+    return true;
+}
+
+// Copies from the reader's buffered block, loading and verifying the block
+// that holds the next offset whenever the buffer does not hold it or the
+// data may have changed since it was loaded.
+static bool read_next_locked(fs_reader_t* reader, uint8_t* data, uint32_t len, uint32_t* read_len) {
+    int file_index = find_file(reader->path);
+    if (file_index == -1 || files[file_index].is_dir) return false;
+
+    uint32_t size = files[file_index].size;
+    int block = files[file_index].first_block;
+    uint32_t base = 0;
+    *read_len = 0;
+    while (len > 0 && reader->offset < size) {
+        while (block >= 0 && reader->offset >= base + FS_BLOCK_SIZE) {
+            block = block_next[block];
+            base += FS_BLOCK_SIZE;
+        }
+        if (block < 0) {
+            return false;
+        }
+        uint32_t used = MIN(FS_BLOCK_SIZE, size - base);
+        if (block != reader->block || used != reader->used || data_epoch != reader->epoch) {
+            reader->block = BLOCK_END;
+            esp_err_t err = esp_partition_read(storage_partition, block_offset(block), reader->buffer, used);
+            if (err == ESP_OK) {
+                err = verify_block(block, used, reader->buffer, 0, used);
+            }
+            if (err != ESP_OK) {
+                return false;
+            }
+            reader->block = block;
+            reader->used = used;
+            reader->epoch = data_epoch;
+        }
+        uint32_t chunk = MIN(len, base + used - reader->offset);
+        memcpy(data, reader->buffer + (reader->offset - base), chunk);
+        data += chunk;
+        len -= chunk;
+        reader->offset += chunk;
+        *read_len += chunk;
+    }
+    return true;
+}
+
+bool fs_read_next(fs_reader_t* reader, uint8_t* data, uint32_t len, uint32_t* read_len) {
+    fs_lock();
+    bool ok = read_next_locked(reader, data, len, read_len);
+    fs_unlock();
+    return ok;
+}
+
+void fs_close_reader(fs_reader_t* reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->block = BLOCK_END;
+}
+
+static bool get_file_size_locked(const char* path, uint32_t* size) {
     int file_index = find_file(path);
     if (file_index == -1 || files[file_index].is_dir) return false;
 
-    memcpy(data, files[file_index].data, files[file_index].size);
     *size = files[file_index].size;
     return true;
 }
 
-bool fs_delete_file(const char* path) {
-    int file_index = find_file(path);
-    if (file_index == -1) {
-        printf("File or directory not found: %s\n", path);
-        return false;
+bool fs_get_file_size(const char* path, uint32_t* size) {
+    fs_lock();
+    bool ok = get_file_size_locked(path, size);
+    fs_unlock();
+    return ok;
+}
+
+void fs_get_stats(fs_stats_t* stats) {
+    fs_lock();
+    memset(stats, 0, sizeof(fs_stats_t));
+    for (uint32_t i = 0; i < num_files; i++) {
+        if (files[i].name[0] == '\0') {
+            continue;
+        }
+        if (files[i].is_dir) {
+            stats->num_dirs++;
+        } else {
+            stats->num_files++;
+        }
+    }
+    stats->total_blocks = NUM_BLOCKS;
+    stats->free_blocks = count_free_blocks();
+    stats->pending_blocks = count_pending_blocks();
+    stats->block_size = FS_BLOCK_SIZE;
+    fs_unlock();
+}
+
+static bool delete_file_locked(const char* path) {
+    int file_index = find_file(path);
+    if (file_index == -1) {
+        printf("File or directory not found: %s\n", path);
+        return false;
+    }
+
+    if (file_index == 0) {
+        printf("Cannot delete root directory\n");
+        return false;
+    }
+
+    if (files[file_index].is_dir) {
+        // Check if directory is empty
+        for (int i = 0; i < num_files; i++) {
+            if (files[i].parent_dir == file_index) {
+                printf("Cannot delete non-empty directory: %s\n", path);
+                return false;
+            }
+        }
+    }
+
+    release_chain(files[file_index].first_block);
+    free_slot(file_index);
+    fs_periodic_save();
+    return true;
+}
+
+bool fs_delete_file(const char* path) {
+    fs_lock();
+    bool ok = delete_file_locked(path);
+    fs_unlock();
+    return ok;
+}
+
+static int resolve_dir(const char* path) {
+    int dir_index = (strcmp(path, ".") == 0 || strlen(path) == 0) ? cwd()->dir : find_file(path);
+    if (dir_index == -1 || !files[dir_index].is_dir) {
+        return -1;
+    }
+    return dir_index;
+}
+
+static bool opendir_locked(const char* path, fs_dir_t* dir) {
+    int dir_index = resolve_dir(path);
+    if (dir_index == -1) {
+        return false;
+    }
+    dir->dir_index = dir_index;
+    dir->pos = 0;
+    return true;
+}
+
+bool fs_opendir(const char* path, fs_dir_t* dir) {
+    fs_lock();
+    bool ok = opendir_locked(path, dir);
+    fs_unlock();
+    return ok;
+}
+
+bool fs_readdir(fs_dir_t* dir, fs_dirent_t* entry) {
+    return fs_readdir_batch(dir, entry, 1) == 1;
+}
+
+static uint32_t readdir_batch_locked(fs_dir_t* dir, fs_dirent_t* entries, uint32_t max_entries) {
+    uint32_t count = 0;
+    if (dir->dir_index < 0 || !files[dir->dir_index].is_dir) {
+        return 0;
+    }
+
+    while (count < max_entries && dir->pos < num_files) {
+        uint32_t i = dir->pos++;
+        if (files[i].parent_dir != dir->dir_index || files[i].name[0] == '\0') {
+            continue;
+        }
+        fs_dirent_t* entry = &entries[count++];
+        strcpy(entry->name, files[i].name);
+        entry->type = files[i].is_dir ? FS_TYPE_DIR : FS_TYPE_FILE;
+        entry->size = files[i].size;
+        entry->inode = i;
+    }
+    return count;
+}
+
+uint32_t fs_readdir_batch(fs_dir_t* dir, fs_dirent_t* entries, uint32_t max_entries) {
+    fs_lock();
+    uint32_t count = readdir_batch_locked(dir, entries, max_entries);
+    fs_unlock();
+    return count;
+}
+
+void fs_rewinddir(fs_dir_t* dir) {
+    dir->pos = 0;
+}
+
+void fs_closedir(fs_dir_t* dir) {
+    dir->dir_index = -1;
+    dir->pos = 0;
+}
+
+static int compare_dirents(const void* a, const void* b) {
+    return strcmp(((const fs_dirent_t*)a)->name, ((const fs_dirent_t*)b)->name);
+}
+
+static void print_dirent(const fs_dirent_t* entry) {
+    if (entry->type == FS_TYPE_DIR) {
+        printf("%s/\n", entry->name);
+    } else {
+        printf("%s (%" PRIu32 " bytes)\n", entry->name, entry->size);
+    }
+}
+
+void fs_list_files(const char* path) {
+    fs_list_files_sorted(path, false);
+}
+
+void fs_list_files_sorted(const char* path, bool sorted) {
+    fs_dir_t dir;
+    if (!fs_opendir(path, &dir)) {
+        printf("Invalid directory: %s\n", path);
+        return;
+    }
+
+    // Unsorted listings stream in small batches; sorting needs every entry
+    // up front, which is bounded by the size of the file table.
+    fs_dirent_t batch[8];
+    fs_dirent_t* entries = batch;
+    uint32_t capacity = sizeof(batch) / sizeof(batch[0]);
+    if (sorted) {
+        entries = malloc(sizeof(fs_dirent_t) * MAX_FILES);
+        if (!entries) {
+            printf("Out of memory\n");
+            fs_closedir(&dir);
+            return;
+        }
+        capacity = MAX_FILES;
+    }
+
+    uint32_t total = 0;
+    uint32_t count;
+    while ((count = fs_readdir_batch(&dir, entries, capacity)) > 0) {
+        if (sorted) {
+            qsort(entries, count, sizeof(fs_dirent_t), compare_dirents);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            print_dirent(&entries[i]);
+        }
+        total += count;
+    }
+    if (total == 0) {
+        printf("(empty)\n");
+    }
+
+    if (sorted) {
+        free(entries);
+    }
+    fs_closedir(&dir);
+}
+
+// Matches `name` against a shell-style pattern: '*' matches any run of
+// characters and '?' any single character.
+static bool name_matches(const char* pattern, const char* name) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
     }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
 
-    if (files[file_index].is_dir) {
-        // Check if directory is empty
-        for (int i = 0; i < num_files; i++) {
-            if (files[i].parent_dir == file_index) {
-                printf("Cannot delete non-empty directory: %s\n", path);
-                return false;
-            }
+// Writes the absolute path of `slot` by following parent links, so the cost
+// is the depth of the entry rather than the size of the table.
+static bool slot_path(const File* table, int slot, char* path, size_t size) {
+    int chain[MAX_PATH_LENGTH / 2];
+    int depth = 0;
+    for (int i = slot; i > 0; i = table[i].parent_dir) {
+        if (depth == (int)(sizeof(chain) / sizeof(chain[0]))) {
+            return false;
         }
+        chain[depth++] = i;
     }
 
-    // Shift all files after the deleted one
-    for (int i = file_index; i < num_files - 1; i++) {
-        files[i] = files[i + 1];
+    size_t len = 0;
+    for (int d = depth - 1; d >= 0; d--) {
+        size_t name_len = strlen(table[chain[d]].name);
+        if (len + name_len + 2 > size) {
+            return false;
+        }
+        path[len++] = '/';
+        memcpy(path + len, table[chain[d]].name, name_len);
+        len += name_len;
     }
-    num_files--;
-    fs_periodic_save();
+    if (len == 0) {
+        path[len++] = '/';
+    }
+    path[len] = '\0';
     return true;
 }
 
-void fs_list_files(const char* path) {
-    int dir_index = (strcmp(path, ".") == 0 || strlen(path) == 0) ? current_dir : find_file(path);
-
-    if (dir_index == -1 || !files[dir_index].is_dir) {
-        printf("Invalid directory: %s\n", path);
-        return;
-    }
-
-    bool empty = true;
-    for (int i = 0; i < num_files; i++) {
-        if (files[i].parent_dir == dir_index) {
-            empty = false;
-            printf("%s%s", files[i].name, files[i].is_dir ? "/" : "");
-            if (!files[i].is_dir) {
-                printf(" (%" PRIu32 " bytes)", files[i].size);
-            }
+// Only names sharing the pattern's literal prefix (everything before the
+// first wildcard) are visited, and an exact name visits only itself, so the
+// cost follows the number of candidates. A pattern starting with a
+// wildcard has no prefix and visits every name.
+static uint32_t index_find_batch(const name_index_t* index, fs_find_t* find, fs_find_result_t* results,
+                                 uint32_t max_results) {
+    size_t prefix_len = strcspn(find->pattern, "*?");
+    bool exact = (find->pattern[prefix_len] == '\0');
+    char prefix[MAX_FILENAME_LENGTH];
+    memcpy(prefix, find->pattern, prefix_len);
+    prefix[prefix_len] = '\0';
+
+    // Resume after the last entry visited; positions may have shifted
+    // since, but (name, slot) keys have not.
+    uint32_t pos = find->started ? index_lower_bound(index, find->name, find->inode + 1)
+                                 : index_lower_bound(index, prefix, 0);
+    uint32_t count = 0;
+    for (; pos < index->count && count < max_results; pos++) {
+        uint16_t slot = index->order[pos];
+        const File* entry = &index->table[slot];
+        if (exact ? strcmp(entry->name, prefix) != 0 : strncmp(entry->name, prefix, prefix_len) != 0) {
+            break;
+        }
+        strcpy(find->name, entry->name);
+        find->inode = slot;
+        find->started = true;
+        if (!name_matches(find->pattern, entry->name) ||
+            !slot_path(index->table, slot, results[count].path, sizeof(results[count].path))) {
+            continue;
         }
+        results[count].type = entry->is_dir ? FS_TYPE_DIR : FS_TYPE_FILE;
+        results[count].size = entry->size;
+        results[count].inode = slot;
+        count++;
     }
-    if (empty) {
-        printf("(empty)");
+    return count;
+}
+
+bool fs_find_start(fs_find_t* find, const char* pattern) {
+    if (strlen(pattern) == 0 || strlen(pattern) >= sizeof(find->pattern)) {
+        return false;
     }
+    strcpy(find->pattern, pattern);
+    find->name[0] = '\0';
+    find->inode = 0;
+    find->started = false;
+    return true;
 }
 
-bool fs_change_dir(const char* path) {
+uint32_t fs_find_next(fs_find_t* find, fs_find_result_t* results, uint32_t max_results) {
+    fs_lock();
+    uint32_t count = index_find_batch(&name_index, find, results, max_results);
+    fs_unlock();
+    return count;
+}
+
+static bool change_dir_locked(const char* path) {
+    fs_cwd_t* wd = cwd();
     if (strcmp(path, "/") == 0) {
-        current_dir = 0;
-        strcpy(current_path, "/");
+        wd->dir = 0;
+        strcpy(wd->path, "/");
         return true;
     }
 
     if (strcmp(path, "..") == 0) {
-        if (current_dir != 0) {
-            current_dir = files[current_dir].parent_dir;
-            char* last_slash = strrchr(current_path, '/');
-            if (last_slash != current_path) {
+        if (wd->dir != 0) {
+            wd->dir = files[wd->dir].parent_dir;
+            char* last_slash = strrchr(wd->path, '/');
+            if (last_slash != wd->path) {
                 *last_slash = '\0';
             } else {
                 *(last_slash + 1) = '\0';
@@ -287,43 +1222,61 @@ bool fs_change_dir(const char* path) {
         return false;
     }
 
-    current_dir = dir_index;
+    wd->dir = dir_index;
 
-    // Update current_path.
+    // Update the path.
     if (path[0] == '/') {
-        strncpy(current_path, path, MAX_PATH_LENGTH - 1);
+        strncpy(wd->path, path, MAX_PATH_LENGTH - 1);
     } else {
-        if (strcmp(current_path, "/") != 0) {
-            strncat(current_path, "/", MAX_PATH_LENGTH - strlen(current_path) - 1);
+        if (strcmp(wd->path, "/") != 0) {
+            strncat(wd->path, "/", MAX_PATH_LENGTH - strlen(wd->path) - 1);
         }
-        strncat(current_path, path, MAX_PATH_LENGTH - strlen(current_path) - 1);
+        strncat(wd->path, path, MAX_PATH_LENGTH - strlen(wd->path) - 1);
     }
 
     return true;
 }
 
+bool fs_change_dir(const char* path) {
+    fs_lock();
+    bool ok = change_dir_locked(path);
+    fs_unlock();
+    return ok;
+}
+
 void fs_print_working_dir(char* buffer) {
-    strcpy(buffer, current_path);
+    fs_lock();
+    strcpy(buffer, cwd()->path);
+    fs_unlock();
 }
 
-bool fs_make_dir(const char* path) {
-    if (num_files >= MAX_FILES) {
-        printf("Maximum number of files reached.\n");
-        return false;
-    }
+void fs_get_cwd(fs_cwd_t* out) {
+    fs_lock();
+    *out = *cwd();
+    fs_unlock();
+}
+
+fs_cwd_t* fs_current_cwd(void) {
+    return task_cwd;
+}
+
+void fs_use_cwd(fs_cwd_t* dir) {
+    task_cwd = dir;
+}
 
+static bool make_dir_locked(const char* path) {
     char full_path[MAX_PATH_LENGTH];
     if (path[0] == '/') {
         strncpy(full_path, path, MAX_PATH_LENGTH - 1);
         full_path[MAX_PATH_LENGTH - 1] = '\0';
     } else {
-        size_t current_path_len = strlen(current_path);
+        size_t current_path_len = strlen(cwd()->path);
         size_t path_len = strlen(path);
         if (current_path_len + path_len + 2 > MAX_PATH_LENGTH) {
             printf("Path too long\n");
             return false;
         }
-        strcpy(full_path, current_path);
+        strcpy(full_path, cwd()->path);
         if (full_path[current_path_len - 1] != '/') {
             strcat(full_path, "/");
         }
@@ -357,26 +1310,40 @@ bool fs_make_dir(const char* path) {
         return false;
     }
 
-    // Check if directory already exists in parent directory
-    for (int i = 0; i < num_files; i++) {
-        if (files[i].parent_dir == parent_dir && strcmp(files[i].name, dir_name) == 0 && files[i].is_dir) {
-            printf("Directory already exists: %s\n", path);
-            return false;
-        }
+    // Check if the name is already taken in parent directory. A file of the
+    // same name would make the path ambiguous, so it blocks the directory too.
+    int existing = index_find_child(&name_index, parent_dir, dir_name);
+    if (existing != -1) {
+        printf("%s already exists: %s\n", files[existing].is_dir ? "Directory" : "File", path);
+        return false;
+    }
+
+    int slot = alloc_slot();
+    if (slot == -1) {
+        printf("Maximum number of files reached.\n");
+        return false;
     }
 
-    strncpy(files[num_files].name, dir_name, MAX_FILENAME_LENGTH - 1);
-    files[num_files].name[MAX_FILENAME_LENGTH - 1] = '\0';
-    files[num_files].is_dir = true;
-    files[num_files].parent_dir = parent_dir;
-    files[num_files].size = 0;
+    strncpy(files[slot].name, dir_name, MAX_FILENAME_LENGTH - 1);
+    files[slot].name[MAX_FILENAME_LENGTH - 1] = '\0';
+    files[slot].is_dir = true;
+    files[slot].parent_dir = parent_dir;
+    files[slot].size = 0;
+    files[slot].first_block = BLOCK_END;
+    index_insert(&name_index, slot);
 
-    num_files++;
     ESP_LOGI(TAG, "Directory created: %s in directory %s", dir_name, parent_path);
     fs_periodic_save();
     return true;
 }
 
+bool fs_make_dir(const char* path) {
+    fs_lock();
+    bool ok = make_dir_locked(path);
+    fs_unlock();
+    return ok;
+}
+
 
 esp_err_t fs_init_storage(void) {
     storage_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "storage");
@@ -387,21 +1354,28 @@ esp_err_t fs_init_storage(void) {
     ESP_LOGI(TAG, "Storage partition found: offset 0x%" PRIx32 ", size 0x%" PRIx32, 
              storage_partition->address, storage_partition->size);
 
-    // Check if the filesystem is initialized
-    uint8_t header[HEADER_SIZE];
-    esp_err_t err = esp_partition_read(storage_partition, 0, header, HEADER_SIZE);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read storage partition: %s", esp_err_to_name(err));
-        return err;
+    if (storage_partition->size < NUM_SECTORS * SECTOR_SIZE) {
+        ESP_LOGE(TAG, "Storage partition too small, need 0x%x bytes", NUM_SECTORS * SECTOR_SIZE);
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    if (memcmp(header, HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0) {
-        ESP_LOGI(TAG, "Filesystem not initialized. Formatting...");
-        return fs_format_storage();
+    // Check if the filesystem is initialized. Snapshots rotate through the
+    // metadata sectors, so any one of them may hold the header.
+    for (uint32_t i = 0; i < META_SECTORS; i++) {
+        uint8_t header[HEADER_SIZE];
+        esp_err_t err = esp_partition_read(storage_partition, i * SECTOR_SIZE, header, HEADER_SIZE);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read storage partition: %s", esp_err_to_name(err));
+            return err;
+        }
+        if (memcmp(header, HEADER_MAGIC, sizeof(HEADER_MAGIC)) == 0) {
+            ESP_LOGI(TAG, "Filesystem already initialized");
+            return ESP_OK;
+        }
     }
 
-    ESP_LOGI(TAG, "Filesystem already initialized");
-    return ESP_OK;
+    ESP_LOGI(TAG, "Filesystem not initialized. Formatting...");
+    return fs_format_storage();
 }
 
 esp_err_t fs_format_storage(void) {
@@ -415,182 +1389,440 @@ esp_err_t fs_format_storage(void) {
     }
 
     // Initialize with an empty root directory
-    num_files = 1;
-    files[0] = (File){
-        .name = "/",
-        .is_dir = true,
-        .parent_dir = -1,
-        .size = 0
-    };
+    fs_lock();
+    reset_tables();
+    generation = 0;
 
     // Write the initial filesystem state
-    return fs_write_to_flash();
+    err = write_to_flash_locked();
+    fs_unlock();
+    return err;
 }
 
 esp_err_t fs_format(void) {
     ESP_LOGI(TAG, "Formatting filesystem");
-    num_files = 1;
-    memset(files, 0, sizeof(files));
-    strcpy(files[0].name, "/");
-    files[0].is_dir = true;
-    files[0].parent_dir = -1;
-    current_sector = 0;
-    return fs_write_to_flash();
+    fs_lock();
+    reset_tables();
+    esp_err_t err = write_to_flash_locked();
+    fs_unlock();
+    return err;
 }
 
-esp_err_t fs_write_to_flash(void) {
-    uint32_t timestamp = esp_log_timestamp();
-    ESP_LOGI(TAG, "Writing filesystem state to flash, starting from sector %" PRIu32, current_sector);
-
-    size_t total_size = HEADER_SIZE + sizeof(File) * num_files;
-    uint32_t sectors_needed = (total_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+static esp_err_t write_snapshot_locked(void) {
+    ESP_LOGI(TAG, "Writing filesystem state to flash, sector %" PRIu32, current_sector);
 
-    ESP_LOGI(TAG, "Total size: %zu, Sectors needed: %" PRIu32, total_size, sectors_needed);
+    size_t files_size = sizeof(File) * num_files;
+    size_t total_size = HEADER_SIZE + files_size + sizeof(block_next) + sizeof(block_crc);
+    ESP_LOGI(TAG, "Total size: %zu", total_size);
 
-    if (sectors_needed > NUM_SECTORS) {
-        ESP_LOGE(TAG, "Data size exceeds total available storage");
-        return ESP_ERR_INVALID_SIZE;
+    uint8_t* write_buffer = calloc(1, total_size);
+    if (!write_buffer) {
+        ESP_LOGE(TAG, "Failed to allocate write buffer");
+        return ESP_ERR_NO_MEM;
     }
 
-    for (uint32_t i = 0; i < sectors_needed; i++) {
-        uint32_t sector = (current_sector + i) % NUM_SECTORS;
-        esp_err_t err = esp_partition_erase_range(storage_partition, sector * SECTOR_SIZE, SECTOR_SIZE);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to erase sector %" PRIu32 ": %s", sector, esp_err_to_name(err));
-            return err;
-        }
-
-        size_t write_size = (i == 0) ? SECTOR_SIZE : MIN(SECTOR_SIZE, total_size - (i * SECTOR_SIZE));
-        uint8_t* write_buffer = calloc(1, write_size); // Use calloc to zero-initialize
-        if (!write_buffer) {
-            ESP_LOGE(TAG, "Failed to allocate write buffer");
-            return ESP_ERR_NO_MEM;
-        }
-
-        if (i == 0) {
-            // Write header in the first sector
-            memcpy(write_buffer, HEADER_MAGIC, sizeof(HEADER_MAGIC));
-            memcpy(write_buffer + 4, &timestamp, sizeof(timestamp));
-            memcpy(write_buffer + 8, &num_files, sizeof(num_files));
-            memcpy(write_buffer + HEADER_SIZE, files, MIN(write_size - HEADER_SIZE, sizeof(File) * num_files));
-        } else {
-            // Write remaining file data in subsequent sectors
-            size_t offset = (i * SECTOR_SIZE) - HEADER_SIZE;
-            memcpy(write_buffer, (uint8_t*)files + offset, write_size);
-        }
-
-        err = esp_partition_write(storage_partition, sector * SECTOR_SIZE, write_buffer, write_size);
+    uint32_t next_generation = generation + 1;
+    memcpy(write_buffer, HEADER_MAGIC, sizeof(HEADER_MAGIC));
+    memcpy(write_buffer + 4, &next_generation, sizeof(next_generation));
+    memcpy(write_buffer + 8, &num_files, sizeof(num_files));
+    memcpy(write_buffer + HEADER_SIZE, files, files_size);
+    memcpy(write_buffer + HEADER_SIZE + files_size, block_next, sizeof(block_next));
+    memcpy(write_buffer + HEADER_SIZE + files_size + sizeof(block_next), block_crc, sizeof(block_crc));
+    uint32_t crc = esp_rom_crc32_le(0, write_buffer + HEADER_SIZE, total_size - HEADER_SIZE);
+    memcpy(write_buffer + 12, &crc, sizeof(crc));
+
+    esp_err_t err = esp_partition_erase_range(storage_partition, current_sector * SECTOR_SIZE, SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase sector %" PRIu32 ": %s", current_sector, esp_err_to_name(err));
         free(write_buffer);
+        return err;
+    }
 
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write sector %" PRIu32 ": %s", sector, esp_err_to_name(err));
-            return err;
-        } else {
-            ESP_LOGI(TAG, "Successfully wrote sector %" PRIu32, sector);
-        }
+    err = esp_partition_write(storage_partition, current_sector * SECTOR_SIZE, write_buffer, total_size);
+    free(write_buffer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write sector %" PRIu32 ": %s", current_sector, esp_err_to_name(err));
+        return err;
     }
 
-    current_sector = (current_sector + sectors_needed) % NUM_SECTORS;
+    // The new snapshot no longer references released blocks.
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        block_pending[i] = false;
+    }
+
+    generation = next_generation;
+    snapshot_sector = current_sector;
+    snapshot_size = total_size;
+    snapshot_crc = crc;
+    current_sector = (current_sector + 1) % META_SECTORS;
     ESP_LOGI(TAG, "Filesystem state written to flash, next write will start at sector %" PRIu32, current_sector);
     return ESP_OK;
 }
 
+// Every snapshot write goes through here, whether requested, periodic, made
+// to reclaim pending blocks or to repair a damaged snapshot.
+static esp_err_t write_to_flash_locked(void) {
+    TRACE_BEGIN(TRACE_EV_FLASH_WRITE, 0);
+    esp_err_t err = write_snapshot_locked();
+    TRACE_END(TRACE_EV_FLASH_WRITE, (uint32_t)err);
+    return err;
+}
 
-esp_err_t fs_read_from_flash(void) {
-    uint32_t latest_timestamp = 0;
-    uint32_t latest_sector = 0;
+esp_err_t fs_write_to_flash(void) {
+    fs_lock();
+    esp_err_t err = write_to_flash_locked();
+    fs_unlock();
+    return err;
+}
 
-    ESP_LOGI(TAG, "Attempting to read filesystem state from flash");
+// Writes a snapshot only if the tables differ from the last one, so a batch
+// of commands can end with a single flush that costs nothing when the batch
+// changed nothing.
+esp_err_t fs_sync(void) {
+    fs_lock();
+    size_t files_size = sizeof(File) * num_files;
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)files, files_size);
+    crc = esp_rom_crc32_le(crc, (const uint8_t*)block_next, sizeof(block_next));
+    crc = esp_rom_crc32_le(crc, (const uint8_t*)block_crc, sizeof(block_crc));
+
+    esp_err_t err = ESP_OK;
+    if (snapshot_size != HEADER_SIZE + files_size + sizeof(block_next) + sizeof(block_crc) || snapshot_crc != crc) {
+        err = write_to_flash_locked();
+    }
+    fs_unlock();
+    return err;
+}
 
-    // Find the latest valid filesystem state
-    for (uint32_t i = 0; i < NUM_SECTORS; i++) {
-        uint8_t header[HEADER_SIZE];
-        esp_err_t err = esp_partition_read(storage_partition, i * SECTOR_SIZE, header, HEADER_SIZE);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to read sector %" PRIu32 " header: %s", i, esp_err_to_name(err));
-            continue;
-        }
 
-        uint32_t magic;
-        memcpy(&magic, header, sizeof(magic));
-        if (memcmp(&magic, HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0) {
-            continue;  // Skip invalid sectors
-        }
+// Reads the snapshot in `sector` into `buffer` and checks its CRC. Returns its
+// generation, or 0 if the sector holds no valid snapshot.
+static uint32_t load_snapshot(uint32_t sector, uint8_t* buffer) {
+    esp_err_t err = esp_partition_read(storage_partition, sector * SECTOR_SIZE, buffer, SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read sector %" PRIu32 ": %s", sector, esp_err_to_name(err));
+        return 0;
+    }
 
-        uint32_t timestamp;
-        memcpy(&timestamp, header + 4, sizeof(timestamp));
+    if (memcmp(buffer, HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0) {
+        return 0;  // Skip invalid sectors
+    }
 
-        if (timestamp > latest_timestamp) {
-            latest_timestamp = timestamp;
-            latest_sector = i;
-        }
+    uint32_t sector_generation, stored_files, stored_crc;
+    memcpy(&sector_generation, buffer + 4, sizeof(sector_generation));
+    memcpy(&stored_files, buffer + 8, sizeof(stored_files));
+    memcpy(&stored_crc, buffer + 12, sizeof(stored_crc));
+
+    // Validate num_files
+    if (stored_files == 0 || stored_files > MAX_FILES) {
+        ESP_LOGE(TAG, "Invalid number of files in sector %" PRIu32 ": %" PRIu32, sector, stored_files);
+        return 0;
     }
 
-    if (latest_timestamp == 0) {
-        ESP_LOGI(TAG, "No valid filesystem data found in flash");
-        // Initialize filesystem with root directory
-        num_files = 1;
-        memset(files, 0, sizeof(files));
-        strcpy(files[0].name, "/");
-        files[0].is_dir = true;
-        files[0].parent_dir = -1;
-        current_sector = 0;
-        return ESP_OK;
+    size_t total_size = HEADER_SIZE + sizeof(File) * stored_files + sizeof(block_next) + sizeof(block_crc);
+    if (esp_rom_crc32_le(0, buffer + HEADER_SIZE, total_size - HEADER_SIZE) != stored_crc) {
+        ESP_LOGE(TAG, "CRC mismatch in snapshot sector %" PRIu32 " (generation %" PRIu32 ")", sector, sector_generation);
+        return 0;
     }
+    return sector_generation;
+}
+
+static esp_err_t read_from_flash_locked(void) {
+    uint32_t latest_generation = 0;
+    uint32_t latest_sector = 0;
 
-    ESP_LOGI(TAG, "Latest filesystem state found in sector %" PRIu32 " with timestamp %" PRIu32, latest_sector, latest_timestamp);
+    ESP_LOGI(TAG, "Attempting to read filesystem state from flash");
 
-    // Read the entire filesystem state from the latest sector
     uint8_t* read_buffer = malloc(SECTOR_SIZE);
     if (!read_buffer) {
         ESP_LOGE(TAG, "Failed to allocate read buffer");
         return ESP_ERR_NO_MEM;
     }
 
-    esp_err_t err = esp_partition_read(storage_partition, latest_sector * SECTOR_SIZE, read_buffer, SECTOR_SIZE);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read latest sector: %s", esp_err_to_name(err));
+    // Find the latest snapshot that passes its CRC; a torn or rotted one
+    // falls back to the previous generation.
+    for (uint32_t i = 0; i < META_SECTORS; i++) {
+        uint32_t sector_generation = load_snapshot(i, read_buffer);
+        if (sector_generation > latest_generation) {
+            latest_generation = sector_generation;
+            latest_sector = i;
+        }
+    }
+
+    if (latest_generation == 0) {
+        ESP_LOGI(TAG, "No valid filesystem data found in flash");
         free(read_buffer);
-        return err;
+        // Initialize filesystem with root directory
+        reset_tables();
+        generation = 0;
+        return ESP_OK;
     }
 
-    // Parse the header
-    memcpy(&num_files, read_buffer + 8, sizeof(num_files));
-    ESP_LOGI(TAG, "Number of files in filesystem: %" PRIu32, num_files);
+    ESP_LOGI(TAG, "Latest filesystem state found in sector %" PRIu32 " with generation %" PRIu32, latest_sector, latest_generation);
 
-    // Validate num_files
-    if (num_files == 0 || num_files > MAX_FILES) {
-        ESP_LOGE(TAG, "Invalid number of files: %" PRIu32, num_files);
+    if (load_snapshot(latest_sector, read_buffer) != latest_generation) {
         free(read_buffer);
-        return ESP_ERR_INVALID_SIZE;
+        return ESP_ERR_INVALID_CRC;
     }
 
-    // Copy file data
+    // Copy file table and block tables
+    reset_tables();
+    memcpy(&num_files, read_buffer + 8, sizeof(num_files));
     size_t files_data_size = sizeof(File) * num_files;
-    if (files_data_size > SECTOR_SIZE - HEADER_SIZE) {
-        ESP_LOGE(TAG, "File data size exceeds sector size");
-        free(read_buffer);
-        return ESP_ERR_INVALID_SIZE;
-    }
     memcpy(files, read_buffer + HEADER_SIZE, files_data_size);
+    memcpy(block_next, read_buffer + HEADER_SIZE + files_data_size, sizeof(block_next));
+    memcpy(block_crc, read_buffer + HEADER_SIZE + files_data_size + sizeof(block_next), sizeof(block_crc));
+    memcpy(&snapshot_crc, read_buffer + 12, sizeof(snapshot_crc));
 
     free(read_buffer);
 
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (block_next[i] < BLOCK_FREE || block_next[i] >= NUM_BLOCKS) {
+            ESP_LOGE(TAG, "Corrupt block table entry %d: %d", i, block_next[i]);
+            reset_tables();
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    index_build(&name_index, num_files);
+
     // Update current_sector for the next write operation
-    current_sector = (latest_sector + 1) % NUM_SECTORS;
+    generation = latest_generation;
+    snapshot_sector = latest_sector;
+    snapshot_size = HEADER_SIZE + files_data_size + sizeof(block_next) + sizeof(block_crc);
+    current_sector = (latest_sector + 1) % META_SECTORS;
 
     ESP_LOGI(TAG, "Filesystem state restored from flash");
     ESP_LOGI(TAG, "Next write will start at sector %" PRIu32, current_sector);
 
     // Log files for verification
     for (uint32_t i = 0; i < num_files; i++) {
-        ESP_LOGI(TAG, "File %" PRIu32 ": %s, is_dir: %d, parent_dir: %d, size: %" PRIu32,
-                 i, files[i].name, files[i].is_dir, files[i].parent_dir, files[i].size);
+        ESP_LOGI(TAG, "File %" PRIu32 ": %s, is_dir: %d, parent_dir: %d, size: %" PRIu32 ", first_block: %d",
+                 i, files[i].name, files[i].is_dir, files[i].parent_dir, files[i].size, files[i].first_block);
     }
 
     return ESP_OK;
 }
 
+esp_err_t fs_read_from_flash(void) {
+    fs_lock();
+    TRACE_BEGIN(TRACE_EV_FLASH_READ, 0);
+    esp_err_t err = read_from_flash_locked();
+    TRACE_END(TRACE_EV_FLASH_READ, (uint32_t)err);
+    fs_unlock();
+    return err;
+}
+
+
+static void benchmark_throughput_locked(uint32_t size) {
+    uint32_t blocks = blocks_for_size(size);
+    uint32_t available = count_free_blocks() + count_pending_blocks();
+    if (size == 0 || available < blocks) {
+        printf("Need %" PRIu32 " free blocks, have %" PRIu32 "\n", blocks, available);
+        return;
+    }
+
+    uint8_t* data = malloc(size);
+    uint8_t* check = malloc(size);
+    if (!data || !check) {
+        printf("Out of memory\n");
+        free(data);
+        free(check);
+        return;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    // Raw baseline: plain erase/write/read partition calls over the blocks a
+    // file of this size would get, with no CRC or table bookkeeping.
+    int first;
+    if (!alloc_chain(blocks, &first)) {
+        printf("Not enough space for %" PRIu32 " bytes\n", size);
+        free(data);
+        free(check);
+        return;
+    }
+    esp_err_t err = ESP_OK;
+    int64_t start = esp_timer_get_time();
+    for (int block = first, done = 0; err == ESP_OK && block >= 0; ) {
+        uint32_t run = run_length(block, blocks_for_size(size - done));
+        uint32_t len = MIN(size - done, run * FS_BLOCK_SIZE);
+        err = esp_partition_erase_range(storage_partition, block_offset(block), run * SECTOR_SIZE);
+        if (err == ESP_OK) {
+            err = esp_partition_write(storage_partition, block_offset(block), data + done, len);
+        }
+        done += len;
+        block = block_next[block + run - 1];
+    }
+    int64_t raw_write_us = esp_timer_get_time() - start;
+    start = esp_timer_get_time();
+    for (int block = first, done = 0; err == ESP_OK && block >= 0; ) {
+        uint32_t run = run_length(block, blocks_for_size(size - done));
+        uint32_t len = MIN(size - done, run * FS_BLOCK_SIZE);
+        err = esp_partition_read(storage_partition, block_offset(block), check + done, len);
+        done += len;
+        block = block_next[block + run - 1];
+    }
+    int64_t raw_read_us = esp_timer_get_time() - start;
+    discard_chain(first);
+
+    start = esp_timer_get_time();
+    bool ok = err == ESP_OK && write_file_locked("/.bench", data, size);
+    int64_t fs_write_us = esp_timer_get_time() - start;
+    uint32_t read_size = 0;
+    memset(check, 0, size);
+    start = esp_timer_get_time();
+    ok = ok && read_file_locked("/.bench", check, &read_size);
+    int64_t fs_read_us = esp_timer_get_time() - start;
+    ok = ok && read_size == size && memcmp(data, check, size) == 0;
+
+    // The way `read` streams a file: small chunks through a reader.
+    memset(check, 0, size);
+    fs_reader_t reader;
+    start = esp_timer_get_time();
+    ok = ok && fs_open_reader("/.bench", &reader);
+    if (ok) {
+        for (uint32_t offset = 0, len = 0; ok && offset < size; offset += len) {
+            ok = read_next_locked(&reader, check + offset, MIN(256, size - offset), &len) && len > 0;
+        }
+        fs_close_reader(&reader);
+    }
+    int64_t fs_chunked_us = esp_timer_get_time() - start;
+    ok = ok && memcmp(data, check, size) == 0;
+    delete_file_locked("/.bench");
+
+    free(data);
+    free(check);
+    if (!ok) {
+        printf("Benchmark failed\n");
+        return;
+    }
+
+    printf("%" PRIu32 " bytes in %" PRIu32 " blocks\n", size, blocks);
+    printf("  raw write: %8" PRId64 " us (%" PRIu64 " KB/s)\n", raw_write_us, (uint64_t)size * 1000000 / 1024 / (raw_write_us + 1));
+    printf("  fs  write: %8" PRId64 " us (%" PRIu64 " KB/s)\n", fs_write_us, (uint64_t)size * 1000000 / 1024 / (fs_write_us + 1));
+    printf("  raw read:  %8" PRId64 " us (%" PRIu64 " KB/s)\n", raw_read_us, (uint64_t)size * 1000000 / 1024 / (raw_read_us + 1));
+    printf("  fs  read:  %8" PRId64 " us (%" PRIu64 " KB/s)\n", fs_read_us, (uint64_t)size * 1000000 / 1024 / (fs_read_us + 1));
+    printf("  fs  read in 256-byte chunks: %8" PRId64 " us (%" PRIu64 " KB/s)\n", fs_chunked_us,
+           (uint64_t)size * 1000000 / 1024 / (fs_chunked_us + 1));
+}
+
+void fs_benchmark_throughput(uint32_t size) {
+    fs_lock();
+    benchmark_throughput_locked(size);
+    fs_unlock();
+}
+
+// The naive search: recurse through directories, scanning the whole table
+// for each one's children and building paths by concatenation.
+static uint32_t walk_find(const File* table, uint32_t num_entries, int dir, char* path, const char* pattern) {
+    uint32_t matches = 0;
+    size_t len = strlen(path);
+    for (uint32_t i = 1; i < num_entries; i++) {
+        if (table[i].parent_dir != dir || table[i].name[0] == '\0') {
+            continue;
+        }
+        if (len + strlen(table[i].name) + 2 > MAX_PATH_LENGTH) {
+            continue;
+        }
+        strcat(path, "/");
+        strcat(path, table[i].name);
+        if (name_matches(pattern, table[i].name)) {
+            matches++;
+        }
+        if (table[i].is_dir) {
+            matches += walk_find(table, num_entries, i, path, pattern);
+        }
+        path[len] = '\0';
+    }
+    return matches;
+}
+
+// Compares index-backed find with a recursive walk on a synthetic table of
+// `entries` slots: a directory per 32 entries under the root, filled with
+// data files, logs and the odd config file.
+static void benchmark_find_locked(uint32_t entries) {
+    uint32_t dirs = entries / 32;
+    if (entries < 64 || entries > UINT16_MAX) {
+        printf("Entries must be between 64 and %u\n", UINT16_MAX);
+        return;
+    }
+
+    File* table = calloc(entries, sizeof(File));
+    uint16_t* order = malloc(entries * sizeof(uint16_t));
+    fs_find_result_t* results = malloc(16 * sizeof(fs_find_result_t));
+    if (!table || !order || !results) {
+        printf("Not enough memory for %" PRIu32 " entries\n", entries);
+        free(table);
+        free(order);
+        free(results);
+        return;
+    }
+
+    strcpy(table[0].name, "/");
+    table[0].is_dir = true;
+    table[0].parent_dir = -1;
+    for (uint32_t i = 1; i < entries; i++) {
+        File* entry = &table[i];
+        if (i <= dirs) {
+            snprintf(entry->name, MAX_FILENAME_LENGTH, "dir%" PRIu32, i);
+            entry->is_dir = true;
+            entry->parent_dir = 0;
+        } else {
+            if (i % 97 == 0) {
+                snprintf(entry->name, MAX_FILENAME_LENGTH, "settings%" PRIu32 ".cfg", i);
+            } else if (i % 4 == 0) {
+                snprintf(entry->name, MAX_FILENAME_LENGTH, "log%" PRIu32 ".txt", i);
+            } else {
+                snprintf(entry->name, MAX_FILENAME_LENGTH, "data%" PRIu32 ".bin", i);
+            }
+            entry->parent_dir = 1 + i % dirs;
+        }
+        entry->first_block = BLOCK_END;
+    }
+
+    name_index_t index = { table, order, 0 };
+    int64_t start = esp_timer_get_time();
+    index_build(&index, entries);
+    int64_t build_us = esp_timer_get_time() - start;
+    printf("%" PRIu32 " entries in %" PRIu32 " directories, index built in %" PRId64 " us\n", entries, dirs, build_us);
+
+    uint32_t last_data = entries - 1;
+    while (strncmp(table[last_data].name, "data", 4) != 0) {
+        last_data--;
+    }
+    const char* patterns[] = { table[last_data].name, "log1*", "settings*", "*.cfg" };
+    char path[MAX_PATH_LENGTH];
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        fs_find_t find;
+        fs_find_start(&find, patterns[p]);
+        uint32_t found = 0;
+        uint32_t count;
+        start = esp_timer_get_time();
+        while ((count = index_find_batch(&index, &find, results, 16)) > 0) {
+            found += count;
+        }
+        int64_t index_us = esp_timer_get_time() - start;
+
+        path[0] = '\0';
+        start = esp_timer_get_time();
+        uint32_t walked = walk_find(table, entries, 0, path, patterns[p]);
+        int64_t walk_us = esp_timer_get_time() - start;
+
+        printf("  %-16s %5" PRIu32 " matches  index %8" PRId64 " us  walk %8" PRId64 " us%s\n", patterns[p], found,
+               index_us, walk_us, found == walked ? "" : "  MISMATCH");
+    }
+
+    free(table);
+    free(order);
+    free(results);
+}
+
+void fs_benchmark_find(uint32_t entries) {
+    fs_lock();
+    benchmark_find_locked(entries);
+    fs_unlock();
+}
+
 
 
 // Add this function to periodically save the filesystem state
@@ -598,12 +1830,161 @@ void fs_periodic_save(void) {
     static uint32_t last_save_time = 0;
     uint32_t current_time = esp_log_timestamp();
 
+    fs_lock();
     if (current_time - last_save_time > 300000) { // Save every 5 minutes (300,000 ms)
-        fs_write_to_flash();
+        write_to_flash_locked();
         last_save_time = current_time;
     }
+    fs_unlock();
+}
+
+
+// Verifies bytes [from, to) at partition offset `base` against `expected`
+// without holding the lock, a chunk at a time, yielding between chunks so
+// that flash reads never stall other tasks for long.
+static bool scrub_range(size_t base, uint32_t from, uint32_t to, uint32_t expected) {
+    uint32_t crc = 0;
+    for (; from < to; from += CRC_CHUNK_SIZE) {
+        if (crc_flash_range(base, from, MIN(from + CRC_CHUNK_SIZE, to), &crc) != ESP_OK) {
+            return false;
+        }
+        taskYIELD();
+    }
+    return crc == expected;
+}
+
+// Used bytes of a data block, or 0 if no file references it.
+static uint32_t block_used_length(int block) {
+    for (uint32_t i = 0; i < num_files; i++) {
+        if (files[i].name[0] == '\0' || files[i].first_block < 0) {
+            continue;
+        }
+        uint32_t base = 0;
+        for (int b = files[i].first_block; b >= 0; b = block_next[b], base += FS_BLOCK_SIZE) {
+            if (b == block) {
+                return MIN(FS_BLOCK_SIZE, files[i].size - base);
+            }
+        }
+    }
+    return 0;
 }
 
+// Checks one data block per step, or the latest snapshot once per pass. The
+// step is skipped whenever another task holds the lock or has used the
+// filesystem within SCRUB_IDLE_MS, and flash is only read with the lock
+// released; a block that changed meanwhile is simply checked again later.
+static void scrub_step(uint32_t* cursor) {
+    if (xTaskGetTickCount() - last_io_tick < pdMS_TO_TICKS(SCRUB_IDLE_MS)) {
+        return;
+    }
+    if (xSemaphoreTakeRecursive(fs_mutex, 0) != pdTRUE) {
+        return;
+    }
+    // Only steps that do work are traced, so an idle scrubber does not
+    // flood the ring.
+    TRACE_BEGIN(TRACE_EV_SCRUB_STEP, *cursor);
+
+    uint32_t epoch = data_epoch;
+    uint32_t snapshot_generation = generation;
+    int block = -1;
+    uint32_t len = 0;
+    uint32_t expected = 0;
+    if (*cursor < NUM_BLOCKS) {
+        block = *cursor;
+        len = (block_next[block] == BLOCK_FREE) ? 0 : block_used_length(block);
+        expected = block_crc[block];
+    } else if (snapshot_generation > 0) {
+        len = snapshot_size;
+        expected = snapshot_crc;
+    }
+    uint32_t sector = snapshot_sector;
+    xSemaphoreGiveRecursive(fs_mutex);
+
+    bool ok = true;
+    if (block >= 0 && len > 0) {
+        // Retry once so a transient read error is not reported as rot.
+        ok = scrub_range(block_offset(block), 0, len, expected) ||
+             scrub_range(block_offset(block), 0, len, expected);
+    } else if (block < 0 && len > 0) {
+        uint8_t header[HEADER_SIZE];
+        ok = esp_partition_read(storage_partition, sector * SECTOR_SIZE, header, HEADER_SIZE) == ESP_OK &&
+             memcmp(header, HEADER_MAGIC, sizeof(HEADER_MAGIC)) == 0 &&
+             scrub_range(sector * SECTOR_SIZE, HEADER_SIZE, len, expected);
+    }
+
+    // Publishing the result must not make anyone wait either: if the lock
+    // is busy the result is dropped and the same step runs again later.
+    if (xSemaphoreTakeRecursive(fs_mutex, 0) != pdTRUE) {
+        TRACE_END(TRACE_EV_SCRUB_STEP, ok);
+        return;
+    }
+    if (data_epoch == epoch && generation == snapshot_generation) {
+        if (block >= 0) {
+            if (len > 0) {
+                scrub_stats.blocks_checked++;
+                if (!ok && !block_bad[block]) {
+                    ESP_LOGE(TAG, "Scrub: data block %d failed its CRC check", block);
+                    block_bad[block] = true;
+                }
+            }
+        } else {
+            if (!ok && len > 0) {
+                // The file table in RAM is authoritative, so a damaged
+                // snapshot is repaired by writing a fresh one. That erases a
+                // sector with the lock held, so it waits for a step that
+                // still finds the filesystem idle; until then the cursor
+                // stays on the snapshot and it is checked again.
+                if (xTaskGetTickCount() - last_io_tick < pdMS_TO_TICKS(SCRUB_IDLE_MS)) {
+                    xSemaphoreGiveRecursive(fs_mutex);
+                    TRACE_END(TRACE_EV_SCRUB_STEP, ok);
+                    return;
+                }
+                ESP_LOGW(TAG, "Scrub: snapshot in sector %" PRIu32 " is damaged, rewriting", sector);
+                if (write_to_flash_locked() == ESP_OK) {
+                    scrub_stats.snapshots_repaired++;
+                }
+            }
+            scrub_stats.passes++;
+        }
+        *cursor = (*cursor + 1) % (NUM_BLOCKS + 1);
+    }
+    xSemaphoreGiveRecursive(fs_mutex);
+    TRACE_END(TRACE_EV_SCRUB_STEP, ok);
+}
+
+static void scrub_task(void* pvParameters) {
+    uint32_t cursor = 0;
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(SCRUB_INTERVAL_MS));
+        scrub_step(&cursor);
+    }
+}
+
+esp_err_t fs_start_scrubber(void) {
+    static TaskHandle_t scrub_handle = NULL;
+    if (scrub_handle != NULL) {
+        return ESP_OK;
+    }
+    if (xTaskCreate(scrub_task, "fs_scrub", 3072, NULL, tskIDLE_PRIORITY + 1, &scrub_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start scrub task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void fs_get_scrub_stats(fs_scrub_stats_t* stats) {
+    fs_lock();
+    *stats = scrub_stats;
+    stats->bad_blocks = 0;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (block_bad[i]) {
+            stats->bad_blocks++;
+        }
+    }
+    fs_unlock();
+}
+
+
 
 
 
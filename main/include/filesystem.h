@@ -8,30 +8,133 @@
 
 #define MAX_FILES 64
 #define MAX_FILENAME_LENGTH 32
-#define MAX_FILE_SIZE 1024
 #define MAX_PATH_LENGTH 256
 #define MAX_DIRS 16
+#define FS_BLOCK_SIZE 4096
 
+// File contents live in chains of FS_BLOCK_SIZE data blocks on flash;
+// first_block is -1 for directories and empty files.
 typedef struct {
     char name[MAX_FILENAME_LENGTH];
-    uint8_t data[MAX_FILE_SIZE];
     uint32_t size;
     bool is_dir;
     int parent_dir;
+    int first_block;
 } File;
 
+typedef struct {
+    uint32_t num_files;
+    uint32_t num_dirs;
+    uint32_t total_blocks;
+    uint32_t free_blocks;
+    uint32_t pending_blocks;
+    uint32_t block_size;
+} fs_stats_t;
+
+typedef struct {
+    uint32_t passes;
+    uint32_t blocks_checked;
+    uint32_t bad_blocks;
+    uint32_t snapshots_repaired;
+} fs_scrub_stats_t;
+
+typedef enum {
+    FS_TYPE_FILE = 0,
+    FS_TYPE_DIR = 1,
+} fs_type_t;
+
+// A directory entry as yielded by fs_readdir(). The name is copied out, so
+// it stays valid after the entry is deleted or its slot reused.
+typedef struct {
+    char name[MAX_FILENAME_LENGTH];
+    fs_type_t type;
+    uint32_t size;
+    uint32_t inode;
+} fs_dirent_t;
+
+// Iterator state for fs_opendir()/fs_readdir(). `pos` is the next table slot
+// to examine, so a caller can stop after any batch and resume later.
+typedef struct {
+    int dir_index;
+    uint32_t pos;
+} fs_dir_t;
+
+// Search state for fs_find_start()/fs_find_next(). Patterns may use '*' and
+// '?'. The position is kept as the last name and inode visited, so a search
+// can resume after the table changed in between.
+typedef struct {
+    char pattern[MAX_FILENAME_LENGTH];
+    char name[MAX_FILENAME_LENGTH];
+    uint32_t inode;
+    bool started;
+} fs_find_t;
+
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    fs_type_t type;
+    uint32_t size;
+    uint32_t inode;
+} fs_find_result_t;
+
+// Sequential reader for fs_open_reader()/fs_read_next(). The block being
+// read is kept in `buffer` once its CRC has been checked, so a file read in
+// chunks smaller than a block is read and verified once per block, and every
+// byte handed out is one that was verified. Nothing is trusted across
+// readers: a new reader checks each block again.
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    uint32_t offset;
+    uint8_t* buffer;
+    int block;
+    uint32_t used;
+    uint32_t epoch;
+} fs_reader_t;
+
+// A working directory: the index of the directory and its path.
+typedef struct {
+    int dir;
+    char path[MAX_PATH_LENGTH];
+} fs_cwd_t;
+
 esp_err_t fs_init(void);
 esp_err_t fs_format_storage(void);
 bool fs_create_file(const char* path, const char* content);
 bool fs_write_file(const char* path, const uint8_t* data, uint32_t size);
+bool fs_append_file(const char* path, const uint8_t* data, uint32_t size);
 bool fs_read_file(const char* path, uint8_t* data, uint32_t* size);
+bool fs_read_file_at(const char* path, uint32_t offset, uint8_t* data, uint32_t len, uint32_t* read_len);
+bool fs_open_reader(const char* path, fs_reader_t* reader);
+bool fs_read_next(fs_reader_t* reader, uint8_t* data, uint32_t len, uint32_t* read_len);
+void fs_close_reader(fs_reader_t* reader);
+bool fs_get_file_size(const char* path, uint32_t* size);
+void fs_get_stats(fs_stats_t* stats);
+void fs_benchmark_throughput(uint32_t size);
+void fs_benchmark_find(uint32_t entries);
+esp_err_t fs_start_scrubber(void);
+void fs_get_scrub_stats(fs_scrub_stats_t* stats);
 bool fs_delete_file(const char* path);
 void fs_list_files(const char* path);
+void fs_list_files_sorted(const char* path, bool sorted);
+bool fs_opendir(const char* path, fs_dir_t* dir);
+bool fs_readdir(fs_dir_t* dir, fs_dirent_t* entry);
+uint32_t fs_readdir_batch(fs_dir_t* dir, fs_dirent_t* entries, uint32_t max_entries);
+void fs_rewinddir(fs_dir_t* dir);
+void fs_closedir(fs_dir_t* dir);
+bool fs_find_start(fs_find_t* find, const char* pattern);
+uint32_t fs_find_next(fs_find_t* find, fs_find_result_t* results, uint32_t max_results);
 bool fs_change_dir(const char* path);
 void fs_print_working_dir(char* buffer);
+// Working directories are per task. A task uses the shell's unless it
+// selects its own with fs_use_cwd(); NULL selects the shell's again.
+// fs_current_cwd() returns the calling task's selection, so a task it starts
+// can share it.
+void fs_get_cwd(fs_cwd_t* out);
+fs_cwd_t* fs_current_cwd(void);
+void fs_use_cwd(fs_cwd_t* dir);
 bool fs_make_dir(const char* path);
 esp_err_t fs_init_storage(void);
 esp_err_t fs_write_to_flash(void);
+esp_err_t fs_sync(void);
 esp_err_t fs_read_from_flash(void);
 void fs_periodic_save(void);
 void fs_dump_state(void);
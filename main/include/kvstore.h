@@ -0,0 +1,66 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define KV_MAX_KEY_LENGTH 24
+#define KV_MAX_VALUE_SIZE 32
+#define KV_TABLE_SIZE 128
+#define KV_MAX_KEYS 96
+#define KV_STORE_PATH "/.kv"
+
+typedef enum {
+    KV_TYPE_NONE = 0,
+    KV_TYPE_I32,
+    KV_TYPE_U32,
+    KV_TYPE_BOOL,
+    KV_TYPE_STR,
+    KV_TYPE_BLOB,
+} kv_type_t;
+
+// Values are stored inline in the hash table, so lookups never touch the
+// filesystem. Getters and the iterator copy values out under the lock:
+// entries move when the table is rehashed and are rewritten in place by
+// concurrent sets, so no pointer into the table is ever handed out.
+typedef struct {
+    char key[KV_MAX_KEY_LENGTH];
+    uint8_t type;
+    uint8_t len;
+    uint32_t hash;
+    union {
+        int32_t i32;
+        uint32_t u32;
+        bool b;
+        char str[KV_MAX_VALUE_SIZE];
+        uint8_t blob[KV_MAX_VALUE_SIZE];
+    } value;
+} kv_entry_t;
+
+typedef struct {
+    uint32_t slot;
+} kv_iter_t;
+
+esp_err_t kv_init(void);
+esp_err_t kv_set_i32(const char* key, int32_t value);
+esp_err_t kv_set_u32(const char* key, uint32_t value);
+esp_err_t kv_set_bool(const char* key, bool value);
+esp_err_t kv_set_str(const char* key, const char* value);
+esp_err_t kv_set_blob(const char* key, const void* data, size_t len);
+esp_err_t kv_get_i32(const char* key, int32_t* value);
+esp_err_t kv_get_u32(const char* key, uint32_t* value);
+esp_err_t kv_get_bool(const char* key, bool* value);
+// Copies the string, terminator included, into `value`. Fails with
+// ESP_ERR_INVALID_SIZE if it does not fit in `size` bytes.
+esp_err_t kv_get_str(const char* key, char* value, size_t size);
+// `len` holds the size of `data` on entry and the blob length on return.
+esp_err_t kv_get_blob(const char* key, void* data, size_t* len);
+esp_err_t kv_delete(const char* key);
+void kv_iter_init(kv_iter_t* it);
+bool kv_iter_next(kv_iter_t* it, kv_entry_t* entry);
+esp_err_t kv_commit(void);
+void kv_benchmark(uint32_t iterations);
+
+#endif // KVSTORE_H
@@ -0,0 +1,24 @@
+#ifndef SHELL_STREAM_H
+#define SHELL_STREAM_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A bounded byte pipe between two tasks, exposed as a pair of stdio streams
+// so that commands can be connected without knowing about it. Writers block
+// while the pipe is full; once the reader is closed further writes fail
+// with EPIPE. The reader sees EOF after the writer is closed and drained.
+typedef struct shell_pipe shell_pipe_t;
+
+shell_pipe_t* shell_pipe_create(size_t capacity);
+FILE* shell_pipe_writer(shell_pipe_t* pipe);
+FILE* shell_pipe_reader(shell_pipe_t* pipe);
+void shell_pipe_delete(shell_pipe_t* pipe);
+
+// A write-only stream that appends to a file in the filesystem, flushing in
+// small chunks. With append == false the file is truncated first. Messages
+// the filesystem prints while writing go to `console`.
+FILE* shell_file_stream(const char* path, bool append, FILE* console);
+
+#endif // SHELL_STREAM_H
@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+// Binary trace events for latency debugging. With CONFIG_OS_TRACE disabled
+// the TRACE_* macros expand to nothing and their arguments are not
+// evaluated, so trace points cost nothing in normal builds.
+
+typedef enum {
+    TRACE_EV_FIND_FILE = 1,   // arg: resulting file index at END
+    TRACE_EV_FLASH_WRITE = 2, // metadata snapshot write; arg: esp_err_t at END
+    TRACE_EV_FLASH_READ = 3,  // metadata snapshot load; arg: esp_err_t at END
+    TRACE_EV_SHELL_CMD = 4,   // arg: first four characters of the command
+    TRACE_EV_SCRUB_STEP = 5,  // arg: cursor at BEGIN (NUM_BLOCKS = snapshot), 1 if intact at END
+} trace_event_id_t;
+
+typedef enum {
+    TRACE_PHASE_INSTANT = 0,
+    TRACE_PHASE_BEGIN = 1,
+    TRACE_PHASE_END = 2,
+} trace_phase_t;
+
+// One record in a core's ring. time_us is the low 32 bits of
+// esp_timer_get_time(); task is derived from the task handle and matches
+// the ids in the task list that trace_dump() prints.
+typedef struct {
+    uint32_t time_us;
+    uint8_t id;
+    uint8_t phase;
+    uint16_t task;
+    uint32_t arg;
+} trace_event_t;
+
+// Packs up to the first four characters of `str` into an event argument.
+static inline uint32_t trace_tag(const char* str) {
+    uint32_t tag = 0;
+    size_t len = strlen(str);
+    memcpy(&tag, str, len < sizeof(tag) ? len : sizeof(tag));
+    return tag;
+}
+
+#if CONFIG_OS_TRACE
+
+void trace_record(uint8_t id, uint8_t phase, uint32_t arg);
+
+// Writes every buffered event as text to `out` (see tools/trace_decode.py
+// for the format). Recording is paused while the rings are read.
+void trace_dump(FILE* out);
+void trace_clear(void);
+
+#define TRACE_BEGIN(id, arg) trace_record((id), TRACE_PHASE_BEGIN, (arg))
+#define TRACE_END(id, arg) trace_record((id), TRACE_PHASE_END, (arg))
+#define TRACE_INSTANT(id, arg) trace_record((id), TRACE_PHASE_INSTANT, (arg))
+
+#else
+
+#define TRACE_BEGIN(id, arg) ((void)0)
+#define TRACE_END(id, arg) ((void)0)
+#define TRACE_INSTANT(id, arg) ((void)0)
+
+#endif // CONFIG_OS_TRACE
+
+#endif // TRACE_H
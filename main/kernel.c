@@ -1,8 +1,13 @@
 #include "include/filesystem.h"
+#include "include/shell_stream.h"
+#include "include/kvstore.h"
+#include "include/trace.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_console.h"
 #include "esp_vfs_dev.h"
@@ -10,13 +15,64 @@
 #include "driver/uart_vfs.h"
 #include "esp_sleep.h"
 #include "esp_err.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include <stdarg.h>
 #include <inttypes.h>
 
 #define PROMPT "4SkinOS> "
 #define MAX_CMD_LENGTH 256
+#define MAX_PIPELINE_STAGES 4
+#define PIPE_BUFFER_SIZE 512
+#define MAX_JOBS 4
+#define MAX_SCRIPT_SIZE 8192
+// Each nested script adds about 1 KB of shell frames to an 8 KB task stack
+// that must still fit the deepest command and printf below it.
+#define MAX_SCRIPT_DEPTH 2
+#define FIND_BATCH 4
 
 void print_banner(void);
 
+// The shell task's own streams; commands in a pipeline see other ones.
+static FILE* console_in;
+static FILE* console_out;
+
+typedef enum {
+    JOB_FREE,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_KILLED
+} job_state_t;
+
+// A command line running in its own task. Only the shell task claims and
+// frees slots; the job task only moves its own slot out of JOB_RUNNING.
+typedef struct {
+    volatile job_state_t state;
+    volatile bool cancel;
+    char cmd[MAX_CMD_LENGTH];
+    fs_cwd_t cwd;  // a copy of the starter's, so cd in the job stays in the job
+} shell_job_t;
+
+static shell_job_t jobs[MAX_JOBS];
+
+// The job the current task works for, if any. Long-running commands poll
+// it so that kill can stop them at a point where no locks are held.
+static __thread shell_job_t* current_job;
+
+// ESP-IDF's default log sink prints to the calling task's stdout, which is a
+// pipe or a file while a command's output is redirected. Logs go to the
+// console instead, so redirected output holds only what the command printed.
+static int console_log_vprintf(const char* format, va_list args) {
+    return vfprintf(console_out, format, args);
+}
+
+static bool shell_cancelled(void) {
+    return current_job != NULL && current_job->cancel;
+}
+
+static void run_line(char* line);
+static void run_script(const char* path);
+
 void initialize_console() {
     /* Disable buffering on stdin and stdout */
     setvbuf(stdin, NULL, _IONBF, 0);
@@ -47,10 +103,659 @@ void initialize_console() {
     uart_vfs_dev_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
 }
 
+static void print_kv_entry(const kv_entry_t* entry) {
+    printf("%s = ", entry->key);
+    switch (entry->type) {
+        case KV_TYPE_I32:
+            printf("%" PRId32 " (i32)\n", entry->value.i32);
+            break;
+        case KV_TYPE_U32:
+            printf("%" PRIu32 " (u32)\n", entry->value.u32);
+            break;
+        case KV_TYPE_BOOL:
+            printf("%s (bool)\n", entry->value.b ? "true" : "false");
+            break;
+        case KV_TYPE_STR:
+            printf("\"%s\" (str)\n", entry->value.str);
+            break;
+        default:
+            printf("%u bytes (blob)\n", entry->len);
+            break;
+    }
+}
+
+static void execute_kv_command(const char* args) {
+    char op[8] = "";
+    char key[KV_MAX_KEY_LENGTH + 1] = "";
+    char value[MAX_CMD_LENGTH] = "";
+    sscanf(args, "%7s %24s %[^\n]", op, key, value);
+
+    if (strcmp(op, "ls") == 0) {
+        kv_iter_t it;
+        kv_entry_t entry;
+        kv_iter_init(&it);
+        while (kv_iter_next(&it, &entry)) {
+            print_kv_entry(&entry);
+        }
+        return;
+    }
+    if (strcmp(op, "commit") == 0) {
+        esp_err_t err = kv_commit();
+        if (err != ESP_OK) {
+            printf("Commit failed: %s\n", esp_err_to_name(err));
+        }
+        return;
+    }
+    if (key[0] == '\0') {
+        printf("Usage: kv get|set|del|ls|commit [key] [value]\n");
+        return;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (strcmp(op, "get") == 0) {
+        kv_iter_t it;
+        kv_entry_t entry;
+        kv_iter_init(&it);
+        err = ESP_ERR_NOT_FOUND;
+        while (kv_iter_next(&it, &entry)) {
+            if (strcmp(entry.key, key) == 0) {
+                print_kv_entry(&entry);
+                err = ESP_OK;
+                break;
+            }
+        }
+    } else if (strcmp(op, "set") == 0) {
+        // Numbers are stored as integers and true/false as booleans;
+        // anything else is a string.
+        char* end;
+        long number = strtol(value, &end, 0);
+        if (value[0] != '\0' && *end == '\0') {
+            err = kv_set_i32(key, (int32_t)number);
+        } else if (strcmp(value, "true") == 0 || strcmp(value, "false") == 0) {
+            err = kv_set_bool(key, value[0] == 't');
+        } else {
+            err = kv_set_str(key, value);
+        }
+    } else if (strcmp(op, "del") == 0) {
+        err = kv_delete(key);
+    } else {
+        printf("Unknown kv command: %s\n", op);
+        return;
+    }
+    if (err != ESP_OK) {
+        printf("kv %s %s failed: %s\n", op, key, esp_err_to_name(err));
+    }
+}
+
+// Commands with large buffers live in their own functions, kept out of
+// line so that their buffers are only on the stack while they run. Inlined,
+// they would enlarge execute_command's frame, which every level of script
+// nesting pays for.
+static NOINLINE_ATTR void execute_write_command(const char* args) {
+    char filename[MAX_PATH_LENGTH];
+    char content[MAX_CMD_LENGTH] = "";
+    int n = sscanf(args, "%255s %255[^\n]", filename, content);
+    if (n == 1 && stdin != console_in) {
+        // At the end of a pipe, store everything that comes through it.
+        FILE* file = shell_file_stream(filename, false, stdout);
+        if (file) {
+            size_t len, total = 0;
+            char chunk[256];
+            while ((len = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+                fwrite(chunk, 1, len, file);
+                total += len;
+            }
+            fclose(file);
+            printf("Content written to file: %s (%zu bytes)\n", filename, total);
+        }
+    } else if (fs_write_file(filename, (uint8_t*)content, strlen(content))) {
+        printf("Content written to file: %s (%zu bytes)\n", filename, strlen(content));
+    }
+}
+
+static NOINLINE_ATTR void execute_read_command(const char* args) {
+    char filename[MAX_PATH_LENGTH];
+    uint8_t chunk[256];
+    uint32_t size, offset = 0, len;
+    sscanf(args, "%255s", filename);
+    if (fs_get_file_size(filename, &size)) {
+        // Stream the file so its size is not limited by the stack. The
+        // header is only for people; pipes and files get the raw bytes.
+        bool console = (stdout == console_out);
+        if (console) {
+            printf("Content of file %s:\n", filename);
+        }
+        fs_reader_t reader;
+        if (fs_open_reader(filename, &reader)) {
+            while (offset < size && !shell_cancelled() &&
+                   fs_read_next(&reader, chunk, sizeof(chunk), &len) && len > 0) {
+                if (fwrite(chunk, 1, len, stdout) != len) {
+                    break;
+                }
+                offset += len;
+            }
+            fs_close_reader(&reader);
+        }
+        if (console) {
+            printf("\n");
+        }
+    }
+}
+
+static NOINLINE_ATTR void execute_grep_command(const char* args) {
+    char pattern[MAX_CMD_LENGTH];
+    char line[MAX_CMD_LENGTH];
+    sscanf(args, "%[^\n]", pattern);
+    if (stdin == console_in) {
+        printf("grep reads from a pipe, e.g. ls | grep %s\n", pattern);
+    } else {
+        while (fgets(line, sizeof(line), stdin)) {
+            if (strstr(line, pattern)) {
+                fputs(line, stdout);
+            }
+        }
+    }
+}
+
+static NOINLINE_ATTR void execute_find_command(const char* args) {
+    char pattern[MAX_CMD_LENGTH];
+    sscanf(args, "%s", pattern);
+    fs_find_t find;
+    uint32_t count;
+    // Each result holds a full path, so a batch is too big for the stack.
+    fs_find_result_t* results = malloc(sizeof(fs_find_result_t) * FIND_BATCH);
+    if (!results) {
+        printf("Out of memory\n");
+    } else if (!fs_find_start(&find, pattern)) {
+        printf("Invalid pattern: %s\n", pattern);
+    } else {
+        // Paths are printed between batches, never with the filesystem
+        // locked, so find can feed a pipe into write.
+        while (!shell_cancelled() && (count = fs_find_next(&find, results, FIND_BATCH)) > 0) {
+            for (uint32_t i = 0; i < count; i++) {
+                printf("%s%s\n", results[i].path, results[i].type == FS_TYPE_DIR ? "/" : "");
+            }
+        }
+    }
+    free(results);
+}
+
+// Runs a single command. Output goes to stdout and input, for commands that
+// take any, comes from stdin; either may be a pipe or a file when the command
+// is part of a pipeline or redirected.
+static void execute_command(char* cmd) {
+    if (strcmp(cmd, "help") == 0) {
+        printf("Available commands:\n");
+        printf("  help - Show this help message\n");
+        printf("  reboot - Save filesystem state and reboot the system\n");
+        printf("  ls [-s] [path] - List files in the current or specified directory (-s sorts by name)\n");
+        printf("  cd <path> - Change current directory\n");
+        printf("  pwd - Print working directory\n");
+        printf("  mkdir <path> - Create a new directory\n");
+        printf("  touch <filename> - Create a new file\n");
+        printf("  write <filename> <content> - Write content to a file\n");
+        printf("  read <filename> - Read content from a file\n");
+        printf("  rm <path> - Delete a file or empty directory\n");
+        printf("  find <pattern> - Print the paths of all entries whose name matches (* and ? allowed)\n");
+        printf("  echo <text> - Print text\n");
+        printf("  grep <text> - Print piped input lines containing text\n");
+        printf("  wc - Count lines, words and bytes of piped input\n");
+        printf("  ps - List tasks\n");
+        printf("  cmd > file, cmd >> file - Write or append command output to a file\n");
+        printf("  cmd1 | cmd2 - Feed the output of cmd1 to cmd2 (write <file> stores it)\n");
+        printf("  cmd & - Run a command line in the background\n");
+        printf("  jobs - List background jobs\n");
+        printf("  kill <job> - Stop a background job at its next check point\n");
+        printf("  run <script> - Run the commands in a file, saving once at the end\n");
+        printf("  fsstat - Show filesystem usage\n");
+        printf("  scrub - Show background integrity scrub results\n");
+        printf("  bench fs [kb] - Compare file and raw partition throughput\n");
+        printf("  bench kv [n] - Compare key-value and path-based setting lookups\n");
+        printf("  bench find [n] - Compare indexed find with a directory walk over n entries\n");
+        printf("  kv get|set|del|ls|commit [key] [value] - Use the key-value store\n");
+        printf("  trace dump|clear - Dump or clear recorded trace events\n");
+        printf("  shutdown - Save filesystem state and shutdown the system\n");
+    } else if (strcmp(cmd, "reboot") == 0) {
+        printf("Saving filesystem state and rebooting...\n");
+        kv_commit();
+        fs_write_to_flash();
+        vTaskDelay(pdMS_TO_TICKS(1000)); // Wait for 1 second
+        esp_restart();
+    } else if (strncmp(cmd, "ls", 2) == 0) {
+        char path[MAX_PATH_LENGTH] = "";
+        const char* args = cmd + 2;
+        while (*args == ' ') {
+            args++;
+        }
+        bool sorted = (strncmp(args, "-s", 2) == 0 && (args[2] == ' ' || args[2] == '\0'));
+        sscanf(sorted ? args + 2 : args, "%255s", path);
+        fs_list_files_sorted(path[0] ? path : ".", sorted);
+    } else if (strncmp(cmd, "cd ", 3) == 0) {
+        char path[MAX_PATH_LENGTH];
+        sscanf(cmd + 3, "%s", path);
+        fs_change_dir(path);
+    } else if (strcmp(cmd, "pwd") == 0) {
+        char current_dir[MAX_PATH_LENGTH];
+        fs_print_working_dir(current_dir);
+        printf("%s\n", current_dir);
+    } else if (strncmp(cmd, "mkdir ", 6) == 0) {
+        char path[MAX_PATH_LENGTH];
+        sscanf(cmd + 6, "%s", path);
+        fs_make_dir(path);
+    } else if (strncmp(cmd, "touch ", 6) == 0) {
+        char filename[MAX_PATH_LENGTH];
+        sscanf(cmd + 6, "%255s", filename);
+        fs_create_file(filename, "");
+    } else if (strcmp(cmd, "shutdown") == 0) {
+        printf("Saving filesystem state and shutting down...\n");
+        kv_commit();
+        esp_err_t err = fs_write_to_flash();
+        if (err != ESP_OK) {
+            printf("Failed to save filesystem state: %s\n", esp_err_to_name(err));
+            printf("Proceeding with shutdown anyway.\n");
+        }
+        vTaskDelay(100 / portTICK_PERIOD_MS); // Give time for the write operation to complete
+        printf("System will reboot now.\n");
+        esp_restart(); // Reboot the system
+    } else if (strncmp(cmd, "write ", 6) == 0) {
+        execute_write_command(cmd + 6);
+    } else if (strncmp(cmd, "read ", 5) == 0) {
+        execute_read_command(cmd + 5);
+    } else if (strcmp(cmd, "fsstat") == 0) {
+        fs_stats_t stats;
+        fs_get_stats(&stats);
+        printf("Files: %" PRIu32 ", directories: %" PRIu32 "\n", stats.num_files, stats.num_dirs);
+        printf("Blocks: %" PRIu32 " total, %" PRIu32 " free, %" PRIu32 " pending (%" PRIu32 " bytes each)\n",
+               stats.total_blocks, stats.free_blocks, stats.pending_blocks, stats.block_size);
+        printf("Free space: %" PRIu32 " bytes\n", stats.free_blocks * stats.block_size);
+    } else if (strcmp(cmd, "scrub") == 0) {
+        fs_scrub_stats_t stats;
+        fs_get_scrub_stats(&stats);
+        printf("Scrub passes: %" PRIu32 ", blocks checked: %" PRIu32 "\n", stats.passes, stats.blocks_checked);
+        printf("Bad blocks: %" PRIu32 ", snapshots repaired: %" PRIu32 "\n", stats.bad_blocks, stats.snapshots_repaired);
+    } else if (strncmp(cmd, "bench", 5) == 0) {
+        char what[16] = "";
+        uint32_t count = 0;
+        sscanf(cmd + 5, "%15s %" SCNu32, what, &count);
+        if (strcmp(what, "fs") == 0) {
+            fs_benchmark_throughput((count ? count : 32) * 1024);
+        } else if (strcmp(what, "kv") == 0) {
+            kv_benchmark(count ? count : 1000);
+        } else if (strcmp(what, "find") == 0) {
+            fs_benchmark_find(count ? count : 2048);
+        } else {
+            printf("Usage: bench fs [kb] | bench kv [lookups] | bench find [entries]\n");
+        }
+    } else if (strncmp(cmd, "echo", 4) == 0 && (cmd[4] == ' ' || cmd[4] == '\0')) {
+        printf("%s\n", cmd[4] ? cmd + 5 : "");
+    } else if (strncmp(cmd, "grep ", 5) == 0) {
+        execute_grep_command(cmd + 5);
+    } else if (strcmp(cmd, "wc") == 0) {
+        if (stdin == console_in) {
+            printf("wc reads from a pipe, e.g. ls | wc\n");
+        } else {
+            uint32_t lines = 0, words = 0, bytes = 0;
+            bool in_word = false;
+            char chunk[256];
+            size_t len;
+            while ((len = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+                for (size_t i = 0; i < len; i++) {
+                    bool space = (chunk[i] == ' ' || chunk[i] == '\n' || chunk[i] == '\t' || chunk[i] == '\r');
+                    if (chunk[i] == '\n') {
+                        lines++;
+                    }
+                    if (!space && !in_word) {
+                        words++;
+                    }
+                    in_word = !space;
+                }
+                bytes += len;
+            }
+            printf("%" PRIu32 " %" PRIu32 " %" PRIu32 "\n", lines, words, bytes);
+        }
+    } else if (strcmp(cmd, "ps") == 0) {
+#if configUSE_TRACE_FACILITY
+        UBaseType_t count = uxTaskGetNumberOfTasks();
+        TaskStatus_t* tasks = malloc(sizeof(TaskStatus_t) * count);
+        if (tasks) {
+            count = uxTaskGetSystemState(tasks, count, NULL);
+            printf("%-16s %5s %4s %6s\n", "NAME", "STATE", "PRIO", "STACK");
+            for (UBaseType_t i = 0; i < count; i++) {
+                printf("%-16s %5c %4u %6" PRIu32 "\n", tasks[i].pcTaskName, "RrBSD?"[tasks[i].eCurrentState],
+                       (unsigned)tasks[i].uxCurrentPriority, (uint32_t)tasks[i].usStackHighWaterMark);
+            }
+            free(tasks);
+        }
+#else
+        printf("ps needs CONFIG_FREERTOS_USE_TRACE_FACILITY\n");
+#endif
+    } else if (strcmp(cmd, "jobs") == 0) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].state == JOB_RUNNING) {
+                printf("[%d] %s  %s\n", i + 1, jobs[i].cancel ? "Stopping" : "Running ", jobs[i].cmd);
+            }
+        }
+    } else if (strncmp(cmd, "kill ", 5) == 0) {
+        int id = atoi(cmd + 5);
+        if (id < 1 || id > MAX_JOBS || jobs[id - 1].state != JOB_RUNNING) {
+            printf("No such job: %s\n", cmd + 5);
+        } else {
+            jobs[id - 1].cancel = true;
+        }
+    } else if (strncmp(cmd, "run ", 4) == 0) {
+        char path[MAX_PATH_LENGTH];
+        sscanf(cmd + 4, "%s", path);
+        run_script(path);
+    } else if (strncmp(cmd, "trace", 5) == 0 && (cmd[5] == ' ' || cmd[5] == '\0')) {
+#if CONFIG_OS_TRACE
+        if (strcmp(cmd, "trace dump") == 0) {
+            trace_dump(stdout);
+        } else if (strcmp(cmd, "trace clear") == 0) {
+            trace_clear();
+        } else {
+            printf("Usage: trace dump|clear\n");
+        }
+#else
+        printf("trace needs CONFIG_OS_TRACE\n");
+#endif
+    } else if (strncmp(cmd, "kv", 2) == 0 && (cmd[2] == ' ' || cmd[2] == '\0')) {
+        execute_kv_command(cmd + 2);
+    } else if (strncmp(cmd, "find ", 5) == 0) {
+        execute_find_command(cmd + 5);
+    } else if (strncmp(cmd, "rm ", 3) == 0) {
+        char path[MAX_PATH_LENGTH];
+        sscanf(cmd + 3, "%s", path);
+        fs_delete_file(path);
+    } else {
+        printf("Unknown command: %s\n", cmd);
+    }
+}
+
+// `in` and `out` belong to the stage and are closed when it finishes; stages
+// without them use the streams of the task that started the pipeline.
+typedef struct {
+    char* cmd;
+    FILE* in;
+    FILE* out;
+    FILE* default_in;
+    FILE* default_out;
+    shell_job_t* job;
+    fs_cwd_t* cwd;
+    SemaphoreHandle_t done;
+} pipeline_stage_t;
+
+static void run_stage(pipeline_stage_t* stage) {
+    stdin = stage->in ? stage->in : stage->default_in;
+    stdout = stage->out ? stage->out : stage->default_out;
+    TRACE_BEGIN(TRACE_EV_SHELL_CMD, trace_tag(stage->cmd));
+    execute_command(stage->cmd);
+    fflush(stdout);
+    TRACE_END(TRACE_EV_SHELL_CMD, trace_tag(stage->cmd));
+
+    stdin = stage->default_in;
+    stdout = stage->default_out;
+    if (stage->in) {
+        fclose(stage->in);
+    }
+    if (stage->out) {
+        fclose(stage->out);
+    }
+}
+
+static void stage_task(void *pvParameters) {
+    pipeline_stage_t* stage = pvParameters;
+    current_job = stage->job;
+    fs_use_cwd(stage->cwd);
+    run_stage(stage);
+    xSemaphoreGive(stage->done);
+    vTaskDelete(NULL);
+}
+
+static char* trim(char* str) {
+    while (*str == ' ') {
+        str++;
+    }
+    char* end = str + strlen(str);
+    while (end > str && end[-1] == ' ') {
+        *--end = '\0';
+    }
+    return str;
+}
+
+// Runs `cmd1 | cmd2 | ...` with an optional trailing `> file` or `>> file`.
+// Every stage but the last runs in its own task and feeds the next one
+// through a bounded pipe, so output streams through without temp files.
+static void run_command_line(char* line) {
+    pipeline_stage_t stages[MAX_PIPELINE_STAGES] = {0};
+    shell_pipe_t* pipes[MAX_PIPELINE_STAGES - 1] = {0};
+    int num_stages = 0;
+
+    char* target = NULL;
+    bool append = false;
+    char* redirect = strchr(line, '>');
+    if (redirect) {
+        append = (redirect[1] == '>');
+        *redirect = '\0';
+        target = trim(redirect + (append ? 2 : 1));
+        if (target[0] == '\0' || strpbrk(target, "|> ")) {
+            printf("Invalid redirection\n");
+            return;
+        }
+    }
+
+    for (char* cursor = line; cursor != NULL; num_stages++) {
+        if (num_stages == MAX_PIPELINE_STAGES) {
+            printf("Too many pipeline stages (max %d)\n", MAX_PIPELINE_STAGES);
+            return;
+        }
+        char* bar = strchr(cursor, '|');
+        if (bar) {
+            *bar = '\0';
+        }
+        stages[num_stages].cmd = trim(cursor);
+        stages[num_stages].default_in = stdin;
+        stages[num_stages].default_out = stdout;
+        stages[num_stages].job = current_job;
+        stages[num_stages].cwd = fs_current_cwd();
+        if (stages[num_stages].cmd[0] == '\0') {
+            printf("Empty command in pipeline\n");
+            return;
+        }
+        cursor = bar ? bar + 1 : NULL;
+    }
+
+    bool ok = true;
+    if (target) {
+        stages[num_stages - 1].out = shell_file_stream(target, append, console_out);
+        ok = (stages[num_stages - 1].out != NULL);
+    }
+    for (int i = 0; ok && i < num_stages - 1; i++) {
+        pipes[i] = shell_pipe_create(PIPE_BUFFER_SIZE);
+        stages[i].done = xSemaphoreCreateBinary();
+        ok = pipes[i] && stages[i].done;
+        if (ok) {
+            stages[i].out = shell_pipe_writer(pipes[i]);
+            stages[i + 1].in = shell_pipe_reader(pipes[i]);
+            ok = stages[i].out && stages[i + 1].in;
+        }
+    }
+
+    int started = 0;
+    while (ok && started < num_stages - 1) {
+        ok = xTaskCreate(stage_task, "pipe", 8192, &stages[started], uxTaskPriorityGet(NULL), NULL) == pdPASS;
+        if (ok) {
+            started++;
+        }
+    }
+
+    if (ok) {
+        run_stage(&stages[num_stages - 1]);
+    } else {
+        printf("Failed to set up pipeline\n");
+        for (int i = started; i < num_stages; i++) {
+            if (stages[i].in) {
+                fclose(stages[i].in);
+            }
+            if (stages[i].out) {
+                fclose(stages[i].out);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_stages - 1; i++) {
+        if (i < started) {
+            xSemaphoreTake(stages[i].done, portMAX_DELAY);
+        }
+        if (stages[i].done) {
+            vSemaphoreDelete(stages[i].done);
+        }
+        if (pipes[i]) {
+            shell_pipe_delete(pipes[i]);
+        }
+    }
+}
+
+static void job_task(void *pvParameters) {
+    shell_job_t* job = pvParameters;
+    char line[MAX_CMD_LENGTH];
+    strcpy(line, job->cmd);
+    current_job = job;
+    fs_use_cwd(&job->cwd);
+
+    // Keystrokes belong to the shell; a job reading stdin sees end of file.
+    FILE* null_in = fopen("/dev/null", "r");
+    if (null_in) {
+        stdin = null_in;
+    }
+    stdout = console_out;
+    run_command_line(line);
+    fflush(stdout);
+    if (null_in) {
+        stdin = console_in;
+        fclose(null_in);
+    }
+
+    job->state = job->cancel ? JOB_KILLED : JOB_DONE;
+    vTaskDelete(NULL);
+}
+
+static void start_job(const char* line) {
+    int slot = -1;
+    for (int i = 0; i < MAX_JOBS && slot == -1; i++) {
+        if (jobs[i].state == JOB_FREE) {
+            slot = i;
+        }
+    }
+    if (slot == -1) {
+        printf("Too many background jobs (max %d)\n", MAX_JOBS);
+        return;
+    }
+
+    shell_job_t* job = &jobs[slot];
+    strcpy(job->cmd, line);
+    fs_get_cwd(&job->cwd);
+    job->cancel = false;
+    job->state = JOB_RUNNING;
+    // One below the shell, so the prompt stays responsive.
+    if (xTaskCreate(job_task, "job", 8192, job, uxTaskPriorityGet(NULL) - 1, NULL) != pdPASS) {
+        job->state = JOB_FREE;
+        printf("Failed to start background job\n");
+        return;
+    }
+    printf("[%d] %s\n", slot + 1, line);
+}
+
+// Reports finished jobs and frees their slots, the way a shell does before
+// showing the next prompt.
+static void reap_jobs(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_state_t state = jobs[i].state;
+        if (state == JOB_DONE || state == JOB_KILLED) {
+            printf("[%d] %s  %s\n", i + 1, state == JOB_DONE ? "Done  " : "Killed", jobs[i].cmd);
+            jobs[i].state = JOB_FREE;
+        }
+    }
+}
+
+// Runs one line typed at the prompt or read from a script. A trailing `&`
+// runs it as a background job; inside a job it just runs in that job.
+static void run_line(char* line) {
+    line = trim(line);
+    size_t len = strlen(line);
+    bool background = (len > 0 && line[len - 1] == '&');
+    if (background) {
+        line[len - 1] = '\0';
+        line = trim(line);
+    }
+    if (background && line[0] == '\0') {
+        printf("Empty background command\n");
+    } else if (background && current_job == NULL) {
+        start_job(line);
+    } else if (line[0] != '\0') {
+        run_command_line(line);
+    }
+}
+
+// Runs a script one line at a time without echoing it. Blank lines and lines
+// starting with '#' are skipped. Nothing is saved per line; one commit at
+// the end persists whatever the script changed.
+static void run_script(const char* path) {
+    static __thread int depth;
+    uint32_t size;
+    if (!fs_get_file_size(path, &size)) {
+        printf("Script not found: %s\n", path);
+        return;
+    }
+    if (size > MAX_SCRIPT_SIZE) {
+        printf("Script too large: %s (max %d bytes)\n", path, MAX_SCRIPT_SIZE);
+        return;
+    }
+    if (depth >= MAX_SCRIPT_DEPTH) {
+        printf("Scripts nested too deeply: %s\n", path);
+        return;
+    }
+
+    char* script = malloc(size + 1);
+    if (!script || !fs_read_file_at(path, 0, (uint8_t*)script, size, &size)) {
+        printf("Failed to read script: %s\n", path);
+        free(script);
+        return;
+    }
+    script[size] = '\0';
+
+    depth++;
+    char* next;
+    for (char* line = script; line != NULL && !shell_cancelled(); line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        line[strcspn(line, "\r")] = '\0';
+        if (strlen(line) >= MAX_CMD_LENGTH) {
+            printf("Line too long in script: %.32s...\n", line);
+            break;
+        }
+        char* cmd = trim(line);
+        if (cmd[0] != '\0' && cmd[0] != '#') {
+            run_line(cmd);
+        }
+    }
+    depth--;
+    free(script);
+
+    if (depth == 0) {
+        kv_commit();
+        fs_sync();
+    }
+}
+
 void shell_task(void *pvParameters) {
     char cmd[MAX_CMD_LENGTH];
     char current_dir[MAX_PATH_LENGTH];
     initialize_console(); 
+    console_in = stdin;
+    console_out = stdout;
+    esp_log_set_vprintf(console_log_vprintf);
 
     vTaskDelay(pdMS_TO_TICKS(100)); // Short delay to ensure output is sent
 
@@ -60,6 +765,7 @@ void shell_task(void *pvParameters) {
         memset(cmd, 0, sizeof(cmd));
         int cmd_index = 0;
 
+        reap_jobs();
         fs_print_working_dir(current_dir);
         printf("\n4SkinOS %s> ", current_dir);
         fflush(stdout);
@@ -87,76 +793,7 @@ void shell_task(void *pvParameters) {
             continue; // Skip processing for empty commands
         }
 
-        if (strcmp(cmd, "help") == 0) {
-            printf("Available commands:\n");
-            printf("  help - Show this help message\n");
-            printf("  reboot - Reboot the system\n");
-            printf("  ls [path] - List files in the current or specified directory\n");
-            printf("  cd <path> - Change current directory\n");
-            printf("  pwd - Print working directory\n");
-            printf("  mkdir <path> - Create a new directory\n");
-            printf("  touch <filename> - Create a new file\n");
-            printf("  write <filename> <content> - Write content to a file\n");
-            printf("  read <filename> - Read content from a file\n");
-            printf("  rm <path> - Delete a file or empty directory\n");
-            printf("  shutdown - Save filesystem state and shutdown the system\n");
-        } else if (strcmp(cmd, "reboot") == 0) {
-            printf("Rebooting...\n");
-            esp_restart();
-        } else if (strncmp(cmd, "ls", 2) == 0) {
-            char path[MAX_PATH_LENGTH] = "";
-            sscanf(cmd + 2, "%s", path);
-            fs_list_files(path[0] ? path : ".");
-        } else if (strncmp(cmd, "cd ", 3) == 0) {
-            char path[MAX_PATH_LENGTH];
-            sscanf(cmd + 3, "%s", path);
-            fs_change_dir(path);
-        } else if (strcmp(cmd, "pwd") == 0) {
-            fs_print_working_dir(current_dir);
-            printf("%s\n", current_dir);
-        } else if (strncmp(cmd, "mkdir ", 6) == 0) {
-            char path[MAX_PATH_LENGTH];
-            sscanf(cmd + 6, "%s", path);
-            fs_make_dir(path);
-        } else if (strncmp(cmd, "touch ", 6) == 0) {
-            char filename[MAX_FILENAME_LENGTH];
-            sscanf(cmd + 6, "%s", filename);
-            fs_create_file(filename, "");
-        } else if (strcmp(cmd, "reboot") == 0) {
-            printf("Saving filesystem state and rebooting...\n");
-            fs_write_to_flash();
-            vTaskDelay(pdMS_TO_TICKS(1000)); // Wait for 1 second
-            esp_restart();
-        } else if (strcmp(cmd, "shutdown") == 0) {
-            printf("Saving filesystem state and shutting down...\n");
-            esp_err_t err = fs_write_to_flash();
-            if (err != ESP_OK) {
-                printf("Failed to save filesystem state: %s\n", esp_err_to_name(err));
-                printf("Proceeding with shutdown anyway.\n");
-            }
-            vTaskDelay(100 / portTICK_PERIOD_MS); // Give time for the write operation to complete
-            printf("System will reboot now.\n");
-            esp_restart(); // Reboot the system
-        } else if (strncmp(cmd, "write ", 6) == 0) {
-            char filename[MAX_FILENAME_LENGTH];
-            char content[MAX_FILE_SIZE];
-            sscanf(cmd + 6, "%s %[^\n]", filename, content);
-            fs_write_file(filename, (uint8_t*)content, strlen(content));
-        } else if (strncmp(cmd, "read ", 5) == 0) {
-            char filename[MAX_FILENAME_LENGTH];
-            uint8_t content[MAX_FILE_SIZE];
-            uint32_t size;
-            sscanf(cmd + 5, "%s", filename);
-            if (fs_read_file(filename, content, &size)) {
-                printf("Content of file %s:\n%.*s\n", filename, (int)size, (char*)content);
-            }
-        } else if (strncmp(cmd, "rm ", 3) == 0) {
-            char path[MAX_PATH_LENGTH];
-            sscanf(cmd + 3, "%s", path);
-            fs_delete_file(path);
-        } else {
-            printf("Unknown command: %s\n", cmd);
-        }
+        run_line(cmd);
         fs_periodic_save();
     }
 }
@@ -183,6 +820,8 @@ void app_main(void) {
     vTaskDelay(1000 / portTICK_PERIOD_MS);
     printf("Initializing filesystem...\n");
     fs_init(); // This now includes reading from flash
+    kv_init();
+    fs_start_scrubber();
     printf("Initializing shell...\n");
     fflush(stdout);
     vTaskDelay(pdMS_TO_TICKS(100));
@@ -0,0 +1,431 @@
+#include "include/kvstore.h"
+#include "include/filesystem.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define KV_SLOT_DELETED 0xFF
+// Every commit costs a metadata snapshot, and snapshots rotate over only a
+// few sectors, so changes are batched for as long as the filesystem's own
+// periodic save. `kv commit`, scripts, reboot and shutdown commit at once.
+#define KV_COMMIT_INTERVAL_MS 300000
+#define KV_BENCH_DIR "/.kvbench"
+#define KV_BENCH_PATH "/.kvbench/value"
+#define KV_BENCH_KEY "kvbench.value"
+
+// Stored file: magic (4 bytes) + entry count (4 bytes), then the live
+// entries as they are laid out in the table.
+#define KV_HEADER_SIZE 8
+
+static const char *TAG = "kvstore";
+static const uint8_t KV_MAGIC[4] = {'K', 'V', '0', '1'};
+
+// Open addressing with linear probing. A slot is empty (KV_TYPE_NONE), a
+// tombstone (KV_SLOT_DELETED) or live; probes stop only at empty slots.
+static kv_entry_t table[KV_TABLE_SIZE];
+static uint32_t live_count = 0;
+static uint32_t deleted_count = 0;
+static bool dirty = false;
+static SemaphoreHandle_t kv_mutex;
+static SemaphoreHandle_t commit_mutex;
+
+static void commit_task(void* pvParameters);
+
+_Static_assert((KV_TABLE_SIZE & (KV_TABLE_SIZE - 1)) == 0, "table size must be a power of two");
+_Static_assert(KV_MAX_KEYS < KV_TABLE_SIZE, "table needs empty slots to terminate probes");
+
+static uint32_t hash_key(const char* key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*key) {
+        hash ^= (uint8_t)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool slot_live(const kv_entry_t* entry) {
+    return entry->type != KV_TYPE_NONE && entry->type != KV_SLOT_DELETED;
+}
+
+// Returns the live entry for `key`, or NULL. Caller holds kv_mutex.
+static kv_entry_t* lookup(const char* key, uint32_t hash) {
+    for (uint32_t i = 0; i < KV_TABLE_SIZE; i++) {
+        kv_entry_t* entry = &table[(hash + i) & (KV_TABLE_SIZE - 1)];
+        if (entry->type == KV_TYPE_NONE) {
+            return NULL;
+        }
+        if (entry->type != KV_SLOT_DELETED && entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Reinserts every live entry so that tombstones stop lengthening probes.
+static void rehash(void) {
+    kv_entry_t* old = malloc(sizeof(table));
+    if (!old) {
+        return;
+    }
+    memcpy(old, table, sizeof(table));
+    memset(table, 0, sizeof(table));
+    deleted_count = 0;
+
+    for (uint32_t i = 0; i < KV_TABLE_SIZE; i++) {
+        if (!slot_live(&old[i])) {
+            continue;
+        }
+        uint32_t slot = old[i].hash & (KV_TABLE_SIZE - 1);
+        while (table[slot].type != KV_TYPE_NONE) {
+            slot = (slot + 1) & (KV_TABLE_SIZE - 1);
+        }
+        table[slot] = old[i];
+    }
+    free(old);
+}
+
+// Returns the entry to store `key` in: its existing one, or a fresh slot.
+static kv_entry_t* insert_slot(const char* key, uint32_t hash) {
+    kv_entry_t* entry = lookup(key, hash);
+    if (entry) {
+        return entry;
+    }
+    if (live_count >= KV_MAX_KEYS) {
+        return NULL;
+    }
+    if (live_count + deleted_count >= KV_MAX_KEYS) {
+        rehash();
+    }
+
+    kv_entry_t* target = NULL;
+    for (uint32_t i = 0; i < KV_TABLE_SIZE && !target; i++) {
+        kv_entry_t* candidate = &table[(hash + i) & (KV_TABLE_SIZE - 1)];
+        if (!slot_live(candidate)) {
+            target = candidate;
+        }
+    }
+    if (target->type == KV_SLOT_DELETED) {
+        deleted_count--;
+    }
+    memset(target, 0, sizeof(kv_entry_t));
+    strcpy(target->key, key);
+    target->hash = hash;
+    live_count++;
+    return target;
+}
+
+static esp_err_t set_value(const char* key, kv_type_t type, const void* data, size_t len) {
+    if (strlen(key) == 0 || strlen(key) >= KV_MAX_KEY_LENGTH) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (len > KV_MAX_VALUE_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    kv_entry_t* entry = insert_slot(key, hash_key(key));
+    if (!entry) {
+        xSemaphoreGive(kv_mutex);
+        ESP_LOGE(TAG, "Key-value store is full (%d keys)", KV_MAX_KEYS);
+        return ESP_ERR_NO_MEM;
+    }
+    entry->type = type;
+    entry->len = len;
+    memset(&entry->value, 0, sizeof(entry->value));
+    memcpy(&entry->value, data, len);
+    dirty = true;
+    xSemaphoreGive(kv_mutex);
+    return ESP_OK;
+}
+
+// Copies a scalar value out under the lock.
+static esp_err_t get_value(const char* key, kv_type_t type, void* out, size_t len) {
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    const kv_entry_t* entry = lookup(key, hash_key(key));
+    esp_err_t err = ESP_OK;
+    if (!entry) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (entry->type != type) {
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        memcpy(out, &entry->value, len);
+    }
+    xSemaphoreGive(kv_mutex);
+    return err;
+}
+
+esp_err_t kv_init(void) {
+    if (kv_mutex == NULL) {
+        kv_mutex = xSemaphoreCreateMutex();
+        commit_mutex = xSemaphoreCreateMutex();
+        if (kv_mutex == NULL || commit_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        if (xTaskCreate(commit_task, "kv_commit", 4096, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start commit task");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    memset(table, 0, sizeof(table));
+    live_count = 0;
+    deleted_count = 0;
+    dirty = false;
+
+    uint32_t size;
+    if (!fs_get_file_size(KV_STORE_PATH, &size)) {
+        xSemaphoreGive(kv_mutex);
+        ESP_LOGI(TAG, "No stored key-value data, starting empty");
+        return ESP_OK;
+    }
+
+    uint8_t* buffer = malloc(size);
+    if (!buffer) {
+        xSemaphoreGive(kv_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    uint32_t count = 0;
+    if (!fs_read_file(KV_STORE_PATH, buffer, &size) || size < KV_HEADER_SIZE ||
+        memcmp(buffer, KV_MAGIC, sizeof(KV_MAGIC)) != 0) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        memcpy(&count, buffer + 4, sizeof(count));
+        if (count > KV_MAX_KEYS || size != KV_HEADER_SIZE + count * sizeof(kv_entry_t)) {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    for (uint32_t i = 0; err == ESP_OK && i < count; i++) {
+        kv_entry_t entry;
+        memcpy(&entry, buffer + KV_HEADER_SIZE + i * sizeof(kv_entry_t), sizeof(kv_entry_t));
+        entry.key[KV_MAX_KEY_LENGTH - 1] = '\0';
+        if (!slot_live(&entry) || entry.len > KV_MAX_VALUE_SIZE) {
+            continue;
+        }
+        kv_entry_t* slot = insert_slot(entry.key, hash_key(entry.key));
+        if (slot) {
+            *slot = entry;
+            slot->hash = hash_key(entry.key);
+        }
+    }
+    free(buffer);
+    xSemaphoreGive(kv_mutex);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Stored key-value data is invalid: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Loaded %" PRIu32 " keys", live_count);
+    return ESP_OK;
+}
+
+esp_err_t kv_set_i32(const char* key, int32_t value) {
+    return set_value(key, KV_TYPE_I32, &value, sizeof(value));
+}
+
+esp_err_t kv_set_u32(const char* key, uint32_t value) {
+    return set_value(key, KV_TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t kv_set_bool(const char* key, bool value) {
+    return set_value(key, KV_TYPE_BOOL, &value, sizeof(value));
+}
+
+esp_err_t kv_set_str(const char* key, const char* value) {
+    size_t len = strlen(value) + 1;
+    return set_value(key, KV_TYPE_STR, value, len);
+}
+
+esp_err_t kv_set_blob(const char* key, const void* data, size_t len) {
+    return set_value(key, KV_TYPE_BLOB, data, len);
+}
+
+esp_err_t kv_get_i32(const char* key, int32_t* value) {
+    return get_value(key, KV_TYPE_I32, value, sizeof(*value));
+}
+
+esp_err_t kv_get_u32(const char* key, uint32_t* value) {
+    return get_value(key, KV_TYPE_U32, value, sizeof(*value));
+}
+
+esp_err_t kv_get_bool(const char* key, bool* value) {
+    return get_value(key, KV_TYPE_BOOL, value, sizeof(*value));
+}
+
+// Copies a variable-length value out under the lock. `len` holds the size
+// of `out` on entry and the value length on return.
+static esp_err_t get_bytes(const char* key, kv_type_t type, void* out, size_t* len) {
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    const kv_entry_t* entry = lookup(key, hash_key(key));
+    esp_err_t err = ESP_OK;
+    if (!entry) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (entry->type != type) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (entry->len > *len) {
+        err = ESP_ERR_INVALID_SIZE;
+    } else {
+        memcpy(out, &entry->value, entry->len);
+        *len = entry->len;
+    }
+    xSemaphoreGive(kv_mutex);
+    return err;
+}
+
+esp_err_t kv_get_str(const char* key, char* value, size_t size) {
+    return get_bytes(key, KV_TYPE_STR, value, &size);
+}
+
+esp_err_t kv_get_blob(const char* key, void* data, size_t* len) {
+    return get_bytes(key, KV_TYPE_BLOB, data, len);
+}
+
+esp_err_t kv_delete(const char* key) {
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    kv_entry_t* entry = lookup(key, hash_key(key));
+    if (!entry) {
+        xSemaphoreGive(kv_mutex);
+        return ESP_ERR_NOT_FOUND;
+    }
+    memset(entry, 0, sizeof(kv_entry_t));
+    entry->type = KV_SLOT_DELETED;
+    live_count--;
+    deleted_count++;
+    dirty = true;
+    xSemaphoreGive(kv_mutex);
+    return ESP_OK;
+}
+
+void kv_iter_init(kv_iter_t* it) {
+    it->slot = 0;
+}
+
+bool kv_iter_next(kv_iter_t* it, kv_entry_t* entry) {
+    bool found = false;
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    while (it->slot < KV_TABLE_SIZE && !found) {
+        if (slot_live(&table[it->slot])) {
+            *entry = table[it->slot];
+            found = true;
+        }
+        it->slot++;
+    }
+    xSemaphoreGive(kv_mutex);
+    return found;
+}
+
+// Writes every key in one file write and makes it durable with at most one
+// metadata snapshot, however many sets and deletes happened since the last
+// commit.
+// The table is only locked while it is copied, so lookups carry on while
+// the flash is written.
+esp_err_t kv_commit(void) {
+    xSemaphoreTake(commit_mutex, portMAX_DELAY);
+    xSemaphoreTake(kv_mutex, portMAX_DELAY);
+    if (!dirty) {
+        xSemaphoreGive(kv_mutex);
+        xSemaphoreGive(commit_mutex);
+        return ESP_OK;
+    }
+
+    size_t size = KV_HEADER_SIZE + live_count * sizeof(kv_entry_t);
+    uint8_t* buffer = malloc(size);
+    if (!buffer) {
+        xSemaphoreGive(kv_mutex);
+        xSemaphoreGive(commit_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(buffer, KV_MAGIC, sizeof(KV_MAGIC));
+    memcpy(buffer + 4, &live_count, sizeof(live_count));
+    uint8_t* out = buffer + KV_HEADER_SIZE;
+    for (uint32_t i = 0; i < KV_TABLE_SIZE; i++) {
+        if (slot_live(&table[i])) {
+            memcpy(out, &table[i], sizeof(kv_entry_t));
+            out += sizeof(kv_entry_t);
+        }
+    }
+    dirty = false;
+    xSemaphoreGive(kv_mutex);
+
+    esp_err_t err = ESP_FAIL;
+    if (fs_write_file(KV_STORE_PATH, buffer, size)) {
+        err = fs_sync();
+    }
+    free(buffer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to commit key-value data: %s", esp_err_to_name(err));
+        xSemaphoreTake(kv_mutex, portMAX_DELAY);
+        dirty = true;
+        xSemaphoreGive(kv_mutex);
+    }
+    xSemaphoreGive(commit_mutex);
+    return err;
+}
+
+// Commits in the background, so changes made by tasks other than the shell
+// are saved even while nobody types a command. kv_commit() returns at once
+// when nothing changed.
+static void commit_task(void* pvParameters) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(KV_COMMIT_INTERVAL_MS));
+        kv_commit();
+    }
+}
+
+void kv_benchmark(uint32_t iterations) {
+    if (iterations == 0) {
+        return;
+    }
+
+    // The path-based equivalent: a small setting in its own file, one
+    // directory down, read back with fs_read_file().
+    uint32_t value = 42;
+    fs_make_dir(KV_BENCH_DIR);
+    if (!fs_write_file(KV_BENCH_PATH, (const uint8_t*)&value, sizeof(value)) ||
+        kv_set_u32(KV_BENCH_KEY, value) != ESP_OK) {
+        printf("Benchmark setup failed\n");
+        fs_delete_file(KV_BENCH_PATH);
+        fs_delete_file(KV_BENCH_DIR);
+        return;
+    }
+
+    uint32_t sum = 0;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t out = 0;
+        kv_get_u32(KV_BENCH_KEY, &out);
+        sum += out;
+    }
+    int64_t kv_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t out = 0;
+        uint32_t size;
+        fs_read_file(KV_BENCH_PATH, (uint8_t*)&out, &size);
+        sum += out;
+    }
+    int64_t fs_us = esp_timer_get_time() - start;
+
+    kv_delete(KV_BENCH_KEY);
+    fs_delete_file(KV_BENCH_PATH);
+    fs_delete_file(KV_BENCH_DIR);
+
+    if (sum != 2 * value * iterations) {
+        printf("Benchmark read back wrong values\n");
+        return;
+    }
+    printf("%" PRIu32 " lookups of a u32 setting\n", iterations);
+    printf("  kv_get_u32:   %8" PRId64 " us (%" PRId64 " ns/op)\n", kv_us, kv_us * 1000 / iterations);
+    printf("  fs_read_file: %8" PRId64 " us (%" PRId64 " ns/op)\n", fs_us, fs_us * 1000 / iterations);
+}
@@ -0,0 +1,135 @@
+#include "include/shell_stream.h"
+#include "include/filesystem.h"
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/stream_buffer.h"
+
+#define STREAM_BUFFER_SIZE 256
+#define PIPE_POLL_MS 20
+
+struct shell_pipe {
+    StreamBufferHandle_t buffer;
+    volatile bool writer_closed;
+    volatile bool reader_closed;
+};
+
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    FILE* console;
+} file_stream_t;
+
+shell_pipe_t* shell_pipe_create(size_t capacity) {
+    shell_pipe_t* pipe = calloc(1, sizeof(shell_pipe_t));
+    if (!pipe) {
+        return NULL;
+    }
+    pipe->buffer = xStreamBufferCreate(capacity, 1);
+    if (!pipe->buffer) {
+        free(pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
+void shell_pipe_delete(shell_pipe_t* pipe) {
+    vStreamBufferDelete(pipe->buffer);
+    free(pipe);
+}
+
+static int pipe_write(void* cookie, const char* data, int len) {
+    shell_pipe_t* pipe = cookie;
+    int sent = 0;
+    while (sent < len && !pipe->reader_closed) {
+        sent += xStreamBufferSend(pipe->buffer, data + sent, len - sent, pdMS_TO_TICKS(PIPE_POLL_MS));
+    }
+    // Once the reader is gone, fail the write so producers can stop early.
+    if (sent == 0 && pipe->reader_closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    return sent;
+}
+
+static int pipe_read(void* cookie, char* data, int len) {
+    shell_pipe_t* pipe = cookie;
+    while (1) {
+        size_t received = xStreamBufferReceive(pipe->buffer, data, len, pdMS_TO_TICKS(PIPE_POLL_MS));
+        if (received > 0) {
+            return received;
+        }
+        // The writer sets the flag only after its last send, so an empty
+        // buffer at this point really is the end of the stream.
+        if (pipe->writer_closed && xStreamBufferBytesAvailable(pipe->buffer) == 0) {
+            return 0;
+        }
+    }
+}
+
+static int pipe_close_writer(void* cookie) {
+    ((shell_pipe_t*)cookie)->writer_closed = true;
+    return 0;
+}
+
+static int pipe_close_reader(void* cookie) {
+    ((shell_pipe_t*)cookie)->reader_closed = true;
+    return 0;
+}
+
+FILE* shell_pipe_writer(shell_pipe_t* pipe) {
+    FILE* stream = funopen(pipe, NULL, pipe_write, NULL, pipe_close_writer);
+    if (stream) {
+        setvbuf(stream, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+    }
+    return stream;
+}
+
+FILE* shell_pipe_reader(shell_pipe_t* pipe) {
+    FILE* stream = funopen(pipe, pipe_read, NULL, NULL, pipe_close_reader);
+    if (stream) {
+        setvbuf(stream, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+    }
+    return stream;
+}
+
+static int file_stream_write(void* cookie, const char* data, int len) {
+    file_stream_t* stream = cookie;
+    // stdout is this stream while a redirected command runs; point it back
+    // at the console so the filesystem's own messages don't loop into it.
+    FILE* target = stdout;
+    stdout = stream->console;
+    bool ok = fs_append_file(stream->path, (const uint8_t*)data, len);
+    stdout = target;
+    return ok ? len : -1;
+}
+
+static int file_stream_close(void* cookie) {
+    free(cookie);
+    return 0;
+}
+
+FILE* shell_file_stream(const char* path, bool append, FILE* console) {
+    uint32_t size;
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return NULL;
+    }
+    if (!append && fs_get_file_size(path, &size) && !fs_delete_file(path)) {
+        return NULL;
+    }
+
+    file_stream_t* cookie = malloc(sizeof(file_stream_t));
+    if (!cookie) {
+        return NULL;
+    }
+    strcpy(cookie->path, path);
+    cookie->console = console;
+
+    FILE* stream = funopen(cookie, NULL, file_stream_write, NULL, file_stream_close);
+    if (!stream) {
+        free(cookie);
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+    return stream;
+}
@@ -0,0 +1,89 @@
+#include "include/trace.h"
+
+#if CONFIG_OS_TRACE
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TRACE_EVENTS CONFIG_OS_TRACE_EVENTS
+#define TRACE_FORMAT_VERSION 1
+
+_Static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0, "CONFIG_OS_TRACE_EVENTS must be a power of two");
+
+// One ring per core. A slot is claimed with an atomic increment of the
+// core's head, so tasks preempting each other on the same core (or one that
+// migrated between reading its core id and claiming) never share a slot,
+// and no lock is taken on the hot path. Heads count every event ever
+// recorded; the ring keeps the last TRACE_EVENTS of them.
+static trace_event_t rings[portNUM_PROCESSORS][TRACE_EVENTS];
+static uint32_t heads[portNUM_PROCESSORS];
+static volatile bool paused = false;
+
+static uint16_t task_id(TaskHandle_t task) {
+    // TCBs are word aligned, so the low bits carry no information.
+    return (uint16_t)((uintptr_t)task >> 2);
+}
+
+void trace_record(uint8_t id, uint8_t phase, uint32_t arg) {
+    if (paused) {
+        return;
+    }
+    uint32_t core = xPortGetCoreID();
+    uint32_t slot = __atomic_fetch_add(&heads[core], 1, __ATOMIC_RELAXED) & (TRACE_EVENTS - 1);
+    trace_event_t* event = &rings[core][slot];
+    event->time_us = (uint32_t)esp_timer_get_time();
+    event->id = id;
+    event->phase = phase;
+    event->task = task_id(xTaskGetCurrentTaskHandle());
+    event->arg = arg;
+}
+
+// Stops recording and gives writers that already passed the check a tick to
+// finish their slot.
+static void pause_recording(void) {
+    paused = true;
+    vTaskDelay(1);
+}
+
+void trace_dump(FILE* out) {
+    pause_recording();
+
+    fprintf(out, "TRACE v%d cores=%d events=%d\n", TRACE_FORMAT_VERSION, portNUM_PROCESSORS, TRACE_EVENTS);
+#if configUSE_TRACE_FACILITY
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    TaskStatus_t* tasks = malloc(sizeof(TaskStatus_t) * count);
+    if (tasks) {
+        count = uxTaskGetSystemState(tasks, count, NULL);
+        for (UBaseType_t i = 0; i < count; i++) {
+            fprintf(out, "TRACE task %04x %s\n", task_id(tasks[i].xHandle), tasks[i].pcTaskName);
+        }
+        free(tasks);
+    }
+#endif
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        uint32_t head = heads[core];
+        uint32_t kept = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+        fprintf(out, "TRACE core=%d count=%" PRIu32 " dropped=%" PRIu32 "\n", core, kept, head - kept);
+        for (uint32_t i = head - kept; i != head; i++) {
+            const trace_event_t* event = &rings[core][i & (TRACE_EVENTS - 1)];
+            fprintf(out, "T %d %08" PRIx32 " %02x %x %04x %08" PRIx32 "\n", core, event->time_us,
+                    event->id, event->phase, event->task, event->arg);
+        }
+    }
+    fprintf(out, "TRACE end\n");
+
+    paused = false;
+}
+
+void trace_clear(void) {
+    pause_recording();
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        heads[core] = 0;
+    }
+    paused = false;
+}
+
+#endif // CONFIG_OS_TRACE
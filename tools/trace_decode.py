@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""Decode the output of the 4SkinOS `trace dump` shell command.
+
+Reads a console capture (other lines are ignored) or a file written with
+`trace dump > /file`, takes the last dump in it, and prints a merged timeline of all cores followed by
+a latency histogram for every event that has BEGIN/END pairs.
+
+Dump format, one record per line:
+    TRACE v1 cores=<n> events=<ring size>
+    TRACE task <task id> <name>
+    TRACE core=<core> count=<kept> dropped=<overwritten>
+    T <core> <time_us hex> <event id hex> <phase> <task id hex> <arg hex>
+    TRACE end
+
+Usage: trace_decode.py [--no-timeline] [--no-histogram] [capture.txt]
+"""
+
+import argparse
+import collections
+import sys
+
+EVENTS = {
+    1: "find_file",
+    2: "flash_write",
+    3: "flash_read",
+    4: "shell_cmd",
+    5: "scrub_step",
+}
+PHASES = {0: "", 1: "BEGIN", 2: "END"}
+PHASE_BEGIN = 1
+PHASE_END = 2
+
+
+WRAP = 1 << 32
+
+
+def parse(lines):
+    tasks = {}
+    events = []
+    last_time = {}
+    for line in lines:
+        # Console captures may carry prompts or log prefixes before a record.
+        for marker in ("TRACE ", "T "):
+            pos = line.find(marker)
+            if pos >= 0:
+                line = line[pos:]
+                break
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] == "TRACE" and fields[1].startswith("v"):
+            # A capture may hold several dumps; only the last one counts.
+            tasks, events, last_time = {}, [], {}
+        elif len(fields) >= 4 and fields[0] == "TRACE" and fields[1] == "task":
+            tasks[int(fields[2], 16)] = " ".join(fields[3:])
+        elif len(fields) == 7 and fields[0] == "T":
+            try:
+                core = int(fields[1])
+                time_us = int(fields[2], 16)
+                event = (int(fields[3], 16), int(fields[4]), int(fields[5], 16), int(fields[6], 16))
+            except ValueError:
+                continue
+            # Timestamps are the low 32 bits of a microsecond clock; unwrap
+            # them per core. Preemption can put a record slightly before its
+            # predecessor, which is not a wrap.
+            base, previous = last_time.get(core, (0, None))
+            if previous is not None and time_us < previous and previous - time_us > WRAP // 2:
+                base += WRAP
+            last_time[core] = (base, time_us)
+            events.append((base + time_us, core) + event)
+    return tasks, align_cores(events)
+
+
+def align_cores(events):
+    """Puts the per-core unwrapped times on one common clock.
+
+    Each core was unwrapped from its own base, so a core whose records
+    straddle a wrap is 2^32 us ahead of one whose records do not. The
+    newest record of each core was written shortly before the dump, so
+    each core is shifted until its newest record lies within 2^31 us
+    before the newest record overall. The raw maximum cannot be used
+    for this: after a wrap it belongs to an old record.
+    """
+    newest = {}
+    for event in events:
+        time_us, core = event[0], event[1]
+        newest[core] = max(newest.get(core, time_us), time_us)
+    if not newest:
+        return events
+    # Circular comparison: a is after b if it is less than half a wrap ahead.
+    anchor = None
+    for time_us in newest.values():
+        if anchor is None or (time_us - anchor) % WRAP < WRAP // 2:
+            anchor = time_us % WRAP
+    shift = {core: anchor - (anchor - time_us) % WRAP - time_us for core, time_us in newest.items()}
+    events = [(event[0] + shift[event[1]],) + event[1:] for event in events]
+    events.sort(key=lambda e: e[0])
+    return events
+
+
+def describe(event_id, arg):
+    name = EVENTS.get(event_id, "event_%02x" % event_id)
+    if event_id == 4:
+        text = arg.to_bytes(4, "little").rstrip(b"\0").decode("ascii", "replace")
+        return "%s '%s'" % (name, text)
+    if event_id == 1 and arg == 0xFFFFFFFF:
+        return "%s -> not found" % name
+    return "%s %d" % (name, arg)
+
+
+def task_name(tasks, task):
+    return tasks.get(task, "%04x" % task)
+
+
+def timeline(tasks, events, out):
+    if not events:
+        return
+    start = events[0][0]
+    open_spans = collections.defaultdict(list)
+    for time_us, core, event_id, phase, task, arg in events:
+        key = (task, event_id)
+        duration = ""
+        if phase == PHASE_BEGIN:
+            open_spans[key].append(time_us)
+        elif phase == PHASE_END and open_spans[key]:
+            duration = "  (%d us)" % (time_us - open_spans[key].pop())
+        out.write("%12.3f ms  core %d  %-16s %-5s %s%s\n" % (
+            (time_us - start) / 1000.0, core, task_name(tasks, task), PHASES.get(phase, "?"),
+            describe(event_id, arg), duration))
+
+
+def latencies(events):
+    """Pairs BEGIN/END records per task and event, allowing nesting.
+
+    Shell commands are grouped by command name, everything else by event.
+    """
+    open_spans = collections.defaultdict(list)
+    result = collections.defaultdict(list)
+    for time_us, _core, event_id, phase, task, arg in events:
+        key = (task, event_id)
+        if phase == PHASE_BEGIN:
+            open_spans[key].append((time_us, arg))
+        elif phase == PHASE_END and open_spans[key]:
+            begin_us, begin_arg = open_spans[key].pop()
+            label = describe(event_id, begin_arg) if event_id == 4 else EVENTS.get(event_id, "event_%02x" % event_id)
+            result[(event_id, label)].append(time_us - begin_us)
+    return result
+
+
+def percentile(sorted_values, fraction):
+    index = min(len(sorted_values) - 1, int(fraction * len(sorted_values)))
+    return sorted_values[index]
+
+
+def histograms(events, out):
+    for (_event_id, label), values in sorted(latencies(events).items()):
+        values.sort()
+        out.write("\n%s: %d spans, min %d us, p50 %d us, p99 %d us, max %d us\n" % (
+            label, len(values), values[0],
+            percentile(values, 0.5), percentile(values, 0.99), values[-1]))
+        # Power-of-two buckets: [0, 1), [1, 2), [2, 4), ...
+        buckets = collections.Counter(value.bit_length() for value in values)
+        widest = max(buckets.values())
+        for bucket in range(min(buckets), max(buckets) + 1):
+            low = 0 if bucket == 0 else 1 << (bucket - 1)
+            high = 1 << bucket
+            count = buckets.get(bucket, 0)
+            bar = "#" * max(1 if count else 0, count * 40 // widest)
+            out.write("  %8d .. %-8d us %6d %s\n" % (low, high, count, bar))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a 4SkinOS trace dump.")
+    parser.add_argument("capture", nargs="?", help="console capture or dump file (default: stdin)")
+    parser.add_argument("--no-timeline", action="store_true", help="only print histograms")
+    parser.add_argument("--no-histogram", action="store_true", help="only print the timeline")
+    args = parser.parse_args()
+
+    source = open(args.capture, errors="replace") if args.capture else sys.stdin
+    with source:
+        tasks, events = parse(source)
+    if not events:
+        sys.exit("no trace records found")
+
+    if not args.no_timeline:
+        timeline(tasks, events, sys.stdout)
+    if not args.no_histogram:
+        histograms(events, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()